@@ -0,0 +1,256 @@
+#ifndef _ASYNC_TREE_H
+ # define _ASYNC_TREE_H
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+#include <pthread.h>
+
+#include "thread_pool.h"
+#include "rw_lock.h"
+
+// most operations a worker takes off the queue at once
+#define ASYNC_BATCH 64
+
+/**
+ * An asynchronous front-end to a tree: callers submit searches,
+ * inserts and deletes without waiting for them, and get the
+ * result through a callback or a future. Submissions go on one
+ * queue, which a few jobs on a pool of workers drain in chunks of
+ * up to ASYNC_BATCH. A worker runs each chunk's consecutive
+ * searches as one search_many under a single read acquisition and
+ * its consecutive writes under a single write acquisition, so a
+ * deep queue costs few lock handoffs. Callbacks run on the worker
+ * once it has let go of the tree. Operations in flight at the same
+ * time may run in any order, as they would on threads of their own.
+ * lock guards the tree in global mode and is NULL otherwise;
+ * cpus, if not empty, is where the workers are pinned.
+ */
+template <class Tree>
+class async_tree {
+public:
+  typedef typename Tree::key_type Key;
+  typedef typename Tree::value_type Value;
+
+  // gets whether a search found its key or a delete its node; inserts always get true
+  typedef std::function<void(bool)> callback;
+
+  async_tree(Tree* tree, rw_lock* lock, int workers,
+	     const std::vector<int>& cpus = std::vector<int>());
+  ~async_tree();
+
+  void search(const Key& key, callback done);
+  void insert(const Key& key, const Value& value, callback done);
+  void erase(const Key& key, callback done);
+  std::future<bool> search(const Key& key);
+  std::future<bool> insert(const Key& key, const Value& value = Value());
+  std::future<bool> erase(const Key& key);
+  void wait_idle();
+private:
+  enum op_kind { search_op, insert_op, erase_op };
+
+  struct op {
+    op_kind kind;
+    Key key;
+    Value value;
+    callback done;
+  };
+
+  Tree* tree;
+  rw_lock* lock;
+  std::deque<op> pending;
+  int draining;      // drain jobs queued or running
+  int max_draining;
+
+  pthread_mutex_t queue_lock;
+  pthread_cond_t idle;
+  thread_pool pool;
+
+  void submit(op_kind kind, const Key& key, const Value& value, callback done);
+  std::future<bool> submit(op_kind kind, const Key& key, const Value& value);
+  void run(std::vector<op>& batch);
+  static void* drain(void* self);
+
+  async_tree(const async_tree&);
+  async_tree& operator=(const async_tree&);
+};
+
+/**
+ * Starts workers threads that run the submitted operations.
+ */
+template <class Tree>
+async_tree<Tree>::async_tree(Tree* tree, rw_lock* lock, int workers, const std::vector<int>& cpus)
+  : pool(workers, cpus)
+{
+  this->tree = tree;
+  this->lock = lock;
+  draining = 0;
+  max_draining = pool.size();
+  pthread_mutex_init(&queue_lock, NULL);
+  pthread_cond_init(&idle, NULL);
+}
+
+/**
+ * Runs whatever is still queued before the workers go away.
+ */
+template <class Tree>
+async_tree<Tree>::~async_tree()
+{
+  wait_idle();
+  pthread_cond_destroy(&idle);
+  pthread_mutex_destroy(&queue_lock);
+}
+
+/**
+ * Queues an operation and makes sure a worker is on its
+ * way, without starting more drain jobs than there are workers.
+ */
+template <class Tree>
+void async_tree<Tree>::submit(op_kind kind, const Key& key, const Value& value, callback done)
+{
+  op o = { kind, key, value, done };
+
+  pthread_mutex_lock(&queue_lock);
+  pending.push_back(o);
+  bool start = draining < max_draining;
+  if(start) draining++;
+  pthread_mutex_unlock(&queue_lock);
+
+  if(start) pool.submit(drain, this);
+}
+
+/**
+ * Queues an operation whose result is delivered through a future.
+ * RETURNS the future.
+ */
+template <class Tree>
+std::future<bool> async_tree<Tree>::submit(op_kind kind, const Key& key, const Value& value)
+{
+  std::shared_ptr<std::promise<bool> > result = std::make_shared<std::promise<bool> >();
+  std::future<bool> f = result->get_future();
+  submit(kind, key, value, [result](bool ok) { result->set_value(ok); });
+  return f;
+}
+
+template <class Tree>
+void async_tree<Tree>::search(const Key& key, callback done)
+{
+  submit(search_op, key, Value(), done);
+}
+
+template <class Tree>
+void async_tree<Tree>::insert(const Key& key, const Value& value, callback done)
+{
+  submit(insert_op, key, value, done);
+}
+
+template <class Tree>
+void async_tree<Tree>::erase(const Key& key, callback done)
+{
+  submit(erase_op, key, Value(), done);
+}
+
+template <class Tree>
+std::future<bool> async_tree<Tree>::search(const Key& key)
+{
+  return submit(search_op, key, Value());
+}
+
+template <class Tree>
+std::future<bool> async_tree<Tree>::insert(const Key& key, const Value& value)
+{
+  return submit(insert_op, key, value);
+}
+
+template <class Tree>
+std::future<bool> async_tree<Tree>::erase(const Key& key)
+{
+  return submit(erase_op, key, Value());
+}
+
+/**
+ * Blocks until every operation submitted so far has
+ * run and had its callback called.
+ */
+template <class Tree>
+void async_tree<Tree>::wait_idle()
+{
+  pthread_mutex_lock(&queue_lock);
+  while(!pending.empty() || draining > 0) {
+    pthread_cond_wait(&idle, &queue_lock);
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Job that takes chunks off the queue and runs
+ * them until the queue is empty.
+ */
+template <class Tree>
+void* async_tree<Tree>::drain(void* self)
+{
+  async_tree* a = (async_tree*) self;
+  std::vector<op> batch;
+
+  pthread_mutex_lock(&a->queue_lock);
+  while(!a->pending.empty()) {
+    batch.clear();
+    while(!a->pending.empty() && batch.size() < ASYNC_BATCH) {
+      batch.push_back(a->pending.front());
+      a->pending.pop_front();
+    }
+    pthread_mutex_unlock(&a->queue_lock);
+
+    a->run(batch);
+
+    pthread_mutex_lock(&a->queue_lock);
+  }
+  if(--a->draining == 0) pthread_cond_broadcast(&a->idle);
+  pthread_mutex_unlock(&a->queue_lock);
+  return NULL;
+}
+
+/**
+ * Runs a chunk one run of searches or writes at a time,
+ * then calls the callbacks of the run.
+ */
+template <class Tree>
+void async_tree<Tree>::run(std::vector<op>& batch)
+{
+  std::vector<Key> keys;
+  std::vector<bool> results;
+
+  for(unsigned i = 0; i < batch.size();) {
+    unsigned start = i;
+    bool searches = batch[i].kind == search_op;
+    results.clear();
+
+    if(searches) {
+      keys.clear();
+      for(; i < batch.size() && batch[i].kind == search_op; i++) keys.push_back(batch[i].key);
+      if(lock != NULL) lock->begin_read(0);
+      std::vector<typename Tree::node_p> found = tree->search_many(keys);
+      if(lock != NULL) lock->end_read(0);
+      for(unsigned j = 0; j < found.size(); j++) results.push_back(found[j] != NULL);
+    }
+    else {
+      if(lock != NULL) lock->begin_write(0);
+      for(; i < batch.size() && batch[i].kind != search_op; i++) {
+	if(batch[i].kind == insert_op) {
+	  tree->insert_node(batch[i].key, batch[i].value);
+	  results.push_back(true);
+	}
+	else results.push_back(tree->erase(batch[i].key));
+      }
+      if(lock != NULL) lock->end_write(0);
+    }
+
+    for(unsigned j = start; j < i; j++) {
+      if(batch[j].done) batch[j].done(results[j - start]);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,700 @@
+#ifndef _BTREE_H
+ # define _BTREE_H
+
+#include <iostream>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <functional>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "node_arena.h"
+#include "rbtree.h"
+
+/**
+ * What every node of a B+-tree starts with: its keys and their
+ * count, which share exactly one cache line for keys of up to
+ * 15 bytes, so searching a node costs one miss however many
+ * keys it is made of.
+ */
+template <class Key>
+struct alignas(64) btree_node {
+  static const int SLOTS = (64 - sizeof(int)) / sizeof(Key) >= 4 ? (64 - sizeof(int)) / sizeof(Key) : 4;
+
+  Key keys[SLOTS];
+  int count;
+};
+
+/**
+ * An inner node; every key in children[i + 1] is at least
+ * keys[i], every key in children[i] is smaller. The children
+ * start on the line after the keys, so the step down to
+ * children[i] touches line 1 + i * sizeof(void*) / 64 and
+ * nothing else.
+ */
+template <class Key>
+struct btree_inner : btree_node<Key> {
+  btree_node<Key>* children[btree_node<Key>::SLOTS + 1];
+};
+
+// int keys: 15 of them and count in the first line, 16 children in the next two
+static_assert(sizeof(btree_node<int>) == 64 && offsetof(btree_node<int>, count) == 60,
+	      "a node's keys and count have to share one cache line");
+static_assert(sizeof(btree_inner<int>) == sizeof(btree_node<int>) + 16 * sizeof(void*),
+	      "an inner node's children have to follow its key line");
+
+/**
+ * A leaf, holding the entries themselves; the leaves are
+ * chained in key order for range scans.
+ */
+template <class Key, class Value>
+struct btree_leaf : btree_node<Key> {
+  Value values[btree_node<Key>::SLOTS];
+  btree_leaf* next;
+};
+
+/**
+ * Counts the keys of a node that come before key. The generic
+ * version compares one key after another without branching on
+ * the result; below it, int keys in their natural order are
+ * compared a vector at a time.
+ */
+template <class Key, class Compare>
+struct btree_search {
+  /**
+   * RETURNS the number of the count keys that are smaller than key.
+   */
+  static int below(const Key* keys, int count, const Key& key, const Compare& compare)
+  {
+    int n = 0;
+    for(int i = 0; i < count; i++) n += compare(keys[i], key);
+    return n;
+  }
+
+  /**
+   * RETURNS the number of the count keys that are not larger than key.
+   */
+  static int not_above(const Key* keys, int count, const Key& key, const Compare& compare)
+  {
+    int n = 0;
+    for(int i = 0; i < count; i++) n += !compare(key, keys[i]);
+    return n;
+  }
+};
+
+#ifdef __SSE2__
+template <>
+struct btree_search<int, std::less<int> > {
+  static const int SLOTS = btree_node<int>::SLOTS;
+
+  // one bit per key that is larger than key (above) or smaller than it (!above);
+  // the last vector takes count along, which the callers' count mask drops
+  static unsigned mask(const int* keys, int key, bool above)
+  {
+    unsigned bits = 0;
+#ifdef __AVX2__
+    __m256i k = _mm256_set1_epi32(key);
+    for(int i = 0; i < SLOTS; i += 8) {
+      __m256i v = _mm256_load_si256((const __m256i*) (keys + i));
+      __m256i gt = above ? _mm256_cmpgt_epi32(v, k) : _mm256_cmpgt_epi32(k, v);
+      bits |= (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(gt)) << i;
+    }
+#else
+    __m128i k = _mm_set1_epi32(key);
+    for(int i = 0; i < SLOTS; i += 4) {
+      __m128i v = _mm_load_si128((const __m128i*) (keys + i));
+      __m128i gt = above ? _mm_cmpgt_epi32(v, k) : _mm_cmpgt_epi32(k, v);
+      bits |= (unsigned) _mm_movemask_ps(_mm_castsi128_ps(gt)) << i;
+    }
+#endif
+    return bits;
+  }
+
+  static int below(const int* keys, int count, int key, const std::less<int>&)
+  {
+    return __builtin_popcount(mask(keys, key, false) & ((1u << count) - 1));
+  }
+
+  static int not_above(const int* keys, int count, int key, const std::less<int>&)
+  {
+    return count - __builtin_popcount(mask(keys, key, true) & ((1u << count) - 1));
+  }
+};
+#endif
+
+/**
+ * A B+-tree with the same interface as RBTree, as a second
+ * engine for read-mostly workloads: a node's keys and count fill
+ * one cache line and the child to follow is in one more, so a
+ * search takes about 2 log(n) / log(SLOTS) misses instead of
+ * log2(n). Only the leaves hold entries. It has no locking
+ * modes of its own; like RBTree in global mode, the caller guards
+ * it with a whole-tree lock. Nodes come from two arenas, one for
+ * inner nodes and one for leaves.
+ */
+template <class Key, class Value = rb_empty, class Compare = std::less<Key> >
+class BPlusTree {
+public:
+  typedef Key key_type;
+  typedef Value value_type;
+  typedef btree_node<Key> node;
+  typedef btree_inner<Key> inner;
+  typedef btree_leaf<Key, Value> leaf;
+  // search_tree hands out the key in its leaf
+  typedef const Key* node_p;
+
+  static const int SLOTS = node::SLOTS;
+
+  BPlusTree();
+  ~BPlusTree();
+
+  void build_sorted(const std::vector<Key>& keys);
+  void build_sorted(const std::vector<std::pair<Key, Value> >& entries);
+  void insert_node(const Key& key, const Value& value = Value());
+  void delete_node(const Key& key);
+  bool erase(const Key& key);
+  node_p search_tree(const Key& key);
+  bool lookup(const Key& key, Value& value);
+  template <class F> size_t range_scan(const Key& lo, const Key& hi, F callback);
+  size_t size() { return entries; }
+  int get_height() { return height; }
+  lock_mode get_lock_mode() { return global_lock; }
+  void set_numa_node(int node);
+private:
+  // fewest keys a node other than the root may hold
+  static const int MIN_KEYS = SLOTS / 2;
+
+  node* root;
+  int height;     // levels, 0 for an empty tree and 1 for a lone leaf
+  size_t entries;
+  Compare compare;
+
+  node_arena<inner>* inners;
+  node_arena<leaf>* leaves;
+  int numa_node;  // where both arenas live, -1 for first touch
+
+  BPlusTree(const BPlusTree&);
+  BPlusTree& operator=(const BPlusTree&);
+
+  int below(const node* n, const Key& key) { return btree_search<Key, Compare>::below(n->keys, n->count, key, compare); }
+  int not_above(const node* n, const Key& key) { return btree_search<Key, Compare>::not_above(n->keys, n->count, key, compare); }
+  leaf* find_leaf(const Key& key);
+  bool insert_helper(node* n, int level, const Key& key, const Value& value, Key& up, node*& split);
+  bool erase_helper(node* n, int level, const Key& key);
+  void rebalance(inner* parent, int i, bool leaves_below);
+  leaf* new_leaf();
+  inner* new_inner();
+  void destroy_helper(node* n, int level);
+};
+
+// out-of-class definitions of the B+-tree's members
+#define BT_TEMPLATE template <class Key, class Value, class Compare>
+#define BPLUS_TREE BPlusTree<Key, Value, Compare>
+
+/**
+ * Creates an empty tree.
+ */
+BT_TEMPLATE
+BPLUS_TREE::BPlusTree()
+{
+  root = NULL;
+  height = 0;
+  entries = 0;
+  inners = NULL;
+  leaves = NULL;
+  numa_node = -1;
+}
+
+/**
+ * Destructs whatever is still in the tree and
+ * releases both arenas.
+ */
+BT_TEMPLATE
+BPLUS_TREE::~BPlusTree()
+{
+  destroy_helper(root, 1);
+  delete inners;
+  delete leaves;
+}
+
+/**
+ * Helper function that destructs every node below n,
+ * which is on the given level counting from the root.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::destroy_helper(node* n, int level)
+{
+  if(n == NULL) return;
+  if(level == height) {
+    ((leaf*) n)->~leaf();
+    return;
+  }
+  inner* in = (inner*) n;
+  for(int i = 0; i <= in->count; i++) {
+    destroy_helper(in->children[i], level + 1);
+  }
+  in->~inner();
+}
+
+/**
+ * Places both arenas, and the nodes already in them, in the
+ * memory of NUMA node node, see RBTree::set_numa_node.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::set_numa_node(int node)
+{
+  numa_node = node;
+  if(node < 0) return;
+  if(leaves != NULL) leaves->bind(node);
+  if(inners != NULL) inners->bind(node);
+}
+
+/**
+ * RETURNS an empty leaf from the leaf arena, creating it on first use.
+ */
+BT_TEMPLATE
+typename BPLUS_TREE::leaf* BPLUS_TREE::new_leaf()
+{
+  if(leaves == NULL) {
+    leaves = new node_arena<leaf>();
+    if(numa_node >= 0) leaves->bind(numa_node);
+  }
+  leaf* l = new (leaves->allocate()) leaf();
+  l->count = 0;
+  l->next = NULL;
+  return l;
+}
+
+/**
+ * RETURNS an empty inner node from the inner arena, creating it on first use.
+ */
+BT_TEMPLATE
+typename BPLUS_TREE::inner* BPLUS_TREE::new_inner()
+{
+  if(inners == NULL) {
+    inners = new node_arena<inner>();
+    if(numa_node >= 0) inners->bind(numa_node);
+  }
+  inner* in = new (inners->allocate()) inner();
+  in->count = 0;
+  return in;
+}
+
+/**
+ * RETURNS the leaf that key belongs in, NULL if the tree is empty.
+ */
+BT_TEMPLATE
+typename BPLUS_TREE::leaf* BPLUS_TREE::find_leaf(const Key& key)
+{
+  node* n = root;
+  for(int level = 1; level < height; level++) {
+    n = ((inner*) n)->children[not_above(n, key)];
+  }
+  return (leaf*) n;
+}
+
+/**
+ * Searches the tree for key.
+ * RETURNS the key in its leaf, NULL if it is not there; the
+ * pointer is only good until the next insert or delete.
+ */
+BT_TEMPLATE
+typename BPLUS_TREE::node_p BPLUS_TREE::search_tree(const Key& key)
+{
+  leaf* l = find_leaf(key);
+  if(l == NULL) return NULL;
+  int i = below(l, key);
+  if(i < l->count && !compare(key, l->keys[i])) return &l->keys[i];
+  return NULL;
+}
+
+/**
+ * Copies the value mapped to key into value.
+ * RETURNS whether key is in the tree.
+ */
+BT_TEMPLATE
+bool BPLUS_TREE::lookup(const Key& key, Value& value)
+{
+  leaf* l = find_leaf(key);
+  if(l == NULL) return false;
+  int i = below(l, key);
+  if(i < l->count && !compare(key, l->keys[i])) {
+    value = l->values[i];
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Inserts a new entry; a key that is already
+ * there keeps its value.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::insert_node(const Key& key, const Value& value)
+{
+  if(root == NULL) {
+    root = new_leaf();
+    height = 1;
+  }
+
+  Key up;
+  node* split = NULL;
+  if(!insert_helper(root, 1, key, value, up, split)) return;
+  entries++;
+
+  // the root split, so the tree grows a level
+  if(split != NULL) {
+    inner* r = new_inner();
+    r->keys[0] = up;
+    r->children[0] = root;
+    r->children[1] = split;
+    r->count = 1;
+    root = r;
+    height++;
+  }
+}
+
+/**
+ * Helper function that inserts the entry below n, which is
+ * on the given level. If n has to split, split is set to its
+ * new right sibling and up to the smallest key under it.
+ * RETURNS false if key was already there.
+ */
+BT_TEMPLATE
+bool BPLUS_TREE::insert_helper(node* n, int level, const Key& key, const Value& value,
+			       Key& up, node*& split)
+{
+  if(level == height) {
+    leaf* l = (leaf*) n;
+    int i = below(l, key);
+    if(i < l->count && !compare(key, l->keys[i])) return false;
+
+    // a full leaf gives its upper half to a new one first
+    if(l->count == SLOTS) {
+      leaf* r = new_leaf();
+      int half = SLOTS / 2;
+      for(int j = half; j < SLOTS; j++) {
+	r->keys[j - half] = l->keys[j];
+	r->values[j - half] = l->values[j];
+      }
+      r->count = SLOTS - half;
+      l->count = half;
+      r->next = l->next;
+      l->next = r;
+      split = r;
+      if(i > half) {
+	l = r;
+	i -= half;
+      }
+    }
+
+    for(int j = l->count; j > i; j--) {
+      l->keys[j] = l->keys[j - 1];
+      l->values[j] = l->values[j - 1];
+    }
+    l->keys[i] = key;
+    l->values[i] = value;
+    l->count++;
+    if(split != NULL) up = split->keys[0];
+    return true;
+  }
+
+  inner* in = (inner*) n;
+  int i = not_above(in, key);
+  Key child_up;
+  node* child_split = NULL;
+  if(!insert_helper(in->children[i], level + 1, key, value, child_up, child_split)) return false;
+  if(child_split == NULL) return true;
+
+  // room for one more separator, then split around the middle one if it is too many
+  Key keys[SLOTS + 1];
+  node* children[SLOTS + 2];
+  int count = in->count;
+  for(int j = 0; j < i; j++) keys[j] = in->keys[j];
+  keys[i] = child_up;
+  for(int j = i; j < count; j++) keys[j + 1] = in->keys[j];
+  for(int j = 0; j <= i; j++) children[j] = in->children[j];
+  children[i + 1] = child_split;
+  for(int j = i + 1; j <= count; j++) children[j + 1] = in->children[j];
+  count++;
+
+  if(count <= SLOTS) {
+    for(int j = 0; j < count; j++) in->keys[j] = keys[j];
+    for(int j = 0; j <= count; j++) in->children[j] = children[j];
+    in->count = count;
+    return true;
+  }
+
+  int mid = count / 2;
+  inner* r = new_inner();
+  in->count = mid;
+  for(int j = 0; j < mid; j++) in->keys[j] = keys[j];
+  for(int j = 0; j <= mid; j++) in->children[j] = children[j];
+  r->count = count - mid - 1;
+  for(int j = 0; j < r->count; j++) r->keys[j] = keys[mid + 1 + j];
+  for(int j = 0; j <= r->count; j++) r->children[j] = children[mid + 1 + j];
+  up = keys[mid];
+  split = r;
+  return true;
+}
+
+/**
+ * Deletes key, complaining like RBTree if it is not there.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::delete_node(const Key& key)
+{
+  if(!erase(key)) {
+    std::cout << "Error: couldn't find " << key << "in the tree." << std::endl;
+  }
+}
+
+/**
+ * Deletes key if it is there.
+ * RETURNS whether it was.
+ */
+BT_TEMPLATE
+bool BPLUS_TREE::erase(const Key& key)
+{
+  if(root == NULL || !erase_helper(root, 1, key)) return false;
+  entries--;
+
+  // an inner root left with a single child gives way to it
+  if(height > 1 && root->count == 0) {
+    inner* old = (inner*) root;
+    root = old->children[0];
+    old->~inner();
+    inners->deallocate(old);
+    height--;
+  }
+  else if(height == 1 && root->count == 0) {
+    ((leaf*) root)->~leaf();
+    leaves->deallocate((leaf*) root);
+    root = NULL;
+    height = 0;
+  }
+  return true;
+}
+
+/**
+ * Helper function that deletes key below n, which is on the
+ * given level, and refills any child that ends up too small.
+ * RETURNS whether key was there.
+ */
+BT_TEMPLATE
+bool BPLUS_TREE::erase_helper(node* n, int level, const Key& key)
+{
+  if(level == height) {
+    leaf* l = (leaf*) n;
+    int i = below(l, key);
+    if(i == l->count || compare(key, l->keys[i])) return false;
+    for(int j = i; j < l->count - 1; j++) {
+      l->keys[j] = l->keys[j + 1];
+      l->values[j] = l->values[j + 1];
+    }
+    l->count--;
+    return true;
+  }
+
+  inner* in = (inner*) n;
+  int i = not_above(in, key);
+  if(!erase_helper(in->children[i], level + 1, key)) return false;
+  if(in->children[i]->count < MIN_KEYS) rebalance(in, i, level + 1 == height);
+  return true;
+}
+
+/**
+ * Refills parent's child i, which has one key too few, with a
+ * key borrowed from a sibling, or merges it with the sibling if
+ * that has none to spare. The separators in parent keep bounding
+ * the keys of their children; they need not be keys that are
+ * still in the tree.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::rebalance(inner* parent, int i, bool leaves_below)
+{
+  // j is the separator between the two children involved
+  int j = i > 0 ? i - 1 : i;
+  node* left = parent->children[j];
+  node* right = parent->children[j + 1];
+  bool from_left = i > 0;
+  node* sibling = from_left ? left : right;
+
+  if(sibling->count > MIN_KEYS) {
+    if(leaves_below) {
+      leaf* l = (leaf*) left;
+      leaf* r = (leaf*) right;
+      if(from_left) {
+	for(int k = r->count; k > 0; k--) {
+	  r->keys[k] = r->keys[k - 1];
+	  r->values[k] = r->values[k - 1];
+	}
+	r->keys[0] = l->keys[l->count - 1];
+	r->values[0] = l->values[l->count - 1];
+	l->count--;
+	r->count++;
+      }
+      else {
+	l->keys[l->count] = r->keys[0];
+	l->values[l->count] = r->values[0];
+	l->count++;
+	for(int k = 0; k < r->count - 1; k++) {
+	  r->keys[k] = r->keys[k + 1];
+	  r->values[k] = r->values[k + 1];
+	}
+	r->count--;
+      }
+      parent->keys[j] = r->keys[0];
+      return;
+    }
+
+    // inner nodes rotate a key through the separator
+    inner* l = (inner*) left;
+    inner* r = (inner*) right;
+    if(from_left) {
+      for(int k = r->count; k > 0; k--) r->keys[k] = r->keys[k - 1];
+      for(int k = r->count + 1; k > 0; k--) r->children[k] = r->children[k - 1];
+      r->keys[0] = parent->keys[j];
+      r->children[0] = l->children[l->count];
+      parent->keys[j] = l->keys[l->count - 1];
+      l->count--;
+      r->count++;
+    }
+    else {
+      l->keys[l->count] = parent->keys[j];
+      l->children[l->count + 1] = r->children[0];
+      l->count++;
+      parent->keys[j] = r->keys[0];
+      for(int k = 0; k < r->count - 1; k++) r->keys[k] = r->keys[k + 1];
+      for(int k = 0; k < r->count; k++) r->children[k] = r->children[k + 1];
+      r->count--;
+    }
+    return;
+  }
+
+  // neither can spare a key, so right is folded into left
+  if(leaves_below) {
+    leaf* l = (leaf*) left;
+    leaf* r = (leaf*) right;
+    for(int k = 0; k < r->count; k++) {
+      l->keys[l->count + k] = r->keys[k];
+      l->values[l->count + k] = r->values[k];
+    }
+    l->count += r->count;
+    l->next = r->next;
+    r->~leaf();
+    leaves->deallocate(r);
+  }
+  else {
+    inner* l = (inner*) left;
+    inner* r = (inner*) right;
+    l->keys[l->count] = parent->keys[j];
+    for(int k = 0; k < r->count; k++) l->keys[l->count + 1 + k] = r->keys[k];
+    for(int k = 0; k <= r->count; k++) l->children[l->count + 1 + k] = r->children[k];
+    l->count += r->count + 1;
+    r->~inner();
+    inners->deallocate(r);
+  }
+
+  for(int k = j; k < parent->count - 1; k++) parent->keys[k] = parent->keys[k + 1];
+  for(int k = j + 1; k < parent->count; k++) parent->children[k] = parent->children[k + 1];
+  parent->count--;
+}
+
+/**
+ * Calls callback(key, value) for every entry with a key in
+ * [lo, hi], in key order, by walking the leaf chain.
+ * RETURNS the number of entries visited.
+ */
+BT_TEMPLATE
+template <class F>
+size_t BPLUS_TREE::range_scan(const Key& lo, const Key& hi, F callback)
+{
+  size_t visited = 0;
+  leaf* l = find_leaf(lo);
+  int i = l == NULL ? 0 : below(l, lo);
+
+  for(; l != NULL; l = l->next, i = 0) {
+    for(; i < l->count; i++) {
+      if(compare(hi, l->keys[i])) return visited;
+      callback(l->keys[i], l->values[i]);
+      visited++;
+    }
+  }
+  return visited;
+}
+
+/**
+ * Builds the tree from a list of keys that is sorted
+ * and has no duplicates, see below.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::build_sorted(const std::vector<Key>& keys)
+{
+  std::vector<std::pair<Key, Value> > entries;
+  entries.reserve(keys.size());
+  for(unsigned i = 0; i < keys.size(); i++) {
+    entries.push_back(std::make_pair(keys[i], Value()));
+  }
+  build_sorted(entries);
+}
+
+/**
+ * Builds an empty tree from a list of entries that is sorted
+ * by key and has no duplicates, one level at a time from the
+ * leaves up. Every level spreads its keys evenly over as few
+ * nodes as will hold them, so the nodes start out nearly full
+ * and searches touch as few of them as possible.
+ */
+BT_TEMPLATE
+void BPLUS_TREE::build_sorted(const std::vector<std::pair<Key, Value> >& entries)
+{
+  if(entries.empty()) return;
+
+  // every node of the level being built, with the smallest key under it
+  std::vector<node*> level;
+  std::vector<Key> lows;
+  size_t count = (entries.size() + SLOTS - 1) / SLOTS;
+  leaf* prev = NULL;
+  for(size_t k = 0, e = 0; k < count; k++) {
+    leaf* l = new_leaf();
+    size_t take = entries.size() * (k + 1) / count - entries.size() * k / count;
+    for(size_t j = 0; j < take; j++, e++) {
+      l->keys[j] = entries[e].first;
+      l->values[j] = entries[e].second;
+    }
+    l->count = take;
+    if(prev != NULL) prev->next = l;
+    prev = l;
+    level.push_back(l);
+    lows.push_back(l->keys[0]);
+  }
+  height = 1;
+
+  while(level.size() > 1) {
+    std::vector<node*> above;
+    std::vector<Key> above_lows;
+    count = (level.size() + SLOTS) / (SLOTS + 1);
+    for(size_t k = 0, c = 0; k < count; k++) {
+      inner* in = new_inner();
+      size_t take = level.size() * (k + 1) / count - level.size() * k / count;
+      above_lows.push_back(lows[c]);
+      for(size_t j = 0; j < take; j++, c++) {
+	in->children[j] = level[c];
+	if(j > 0) in->keys[j - 1] = lows[c];
+      }
+      in->count = take - 1;
+      above.push_back(in);
+    }
+    level.swap(above);
+    lows.swap(above_lows);
+    height++;
+  }
+
+  root = level[0];
+  this->entries = entries.size();
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef _FLAT_COMBINING_H
+ # define _FLAT_COMBINING_H
+
+#include <atomic>
+#include <sched.h>
+
+#include "rw_lock.h"
+#include "rb_stats.h"
+
+// how many times a combiner sweeps the slots before it lets go
+#define COMBINE_PASSES 3
+
+/**
+ * Flat combining for the writers of a tree. A writer does not
+ * queue up on the write lock: it publishes its insert or delete
+ * in a slot of its own and waits on that slot. Whichever writer
+ * wins the combiner flag takes the write lock once, applies
+ * every published operation in one sweep, and marks each one
+ * done, so a burst of writes costs one lock handoff and runs on
+ * one core with the tree hot in its cache. Searches go straight
+ * to the tree. lock guards the tree in global mode and is NULL
+ * otherwise, where the combiner holds the tree's own writer
+ * lock for the sweep.
+ */
+template <class Tree>
+class write_combiner {
+public:
+  typedef typename Tree::key_type Key;
+  typedef typename Tree::value_type Value;
+  typedef typename Tree::node_p node_p;
+
+  write_combiner(Tree* tree, rw_lock* lock);
+
+  void insert_node(const Key& key, const Value& value = Value());
+  void delete_node(const Key& key);
+  bool erase(const Key& key);
+  node_p search_tree(const Key& key);
+private:
+  enum { EMPTY, PENDING, DONE };
+  enum op_kind { insert_op, delete_op, erase_op };
+
+  // one per thread, on a line of its own, so waiting never touches a shared line
+  struct alignas(64) slot {
+    std::atomic<int> state;
+    op_kind op;
+    Key key;
+    Value value;
+    bool result;
+  };
+
+  Tree* tree;
+  rw_lock* lock;
+  alignas(64) std::atomic<bool> combining;
+  slot slots[MAX_READERS];
+
+  bool publish(op_kind op, const Key& key, const Value& value);
+  void combine();
+
+  write_combiner(const write_combiner&);
+  write_combiner& operator=(const write_combiner&);
+};
+
+template <class Tree>
+write_combiner<Tree>::write_combiner(Tree* tree, rw_lock* lock)
+{
+  this->tree = tree;
+  this->lock = lock;
+  combining.store(false);
+  for(int i = 0; i < MAX_READERS; i++) {
+    slots[i].state.store(EMPTY);
+  }
+}
+
+/**
+ * Posts an operation in the calling thread's slot and waits
+ * until some combiner, possibly this thread, has applied it.
+ * RETURNS the operation's result.
+ */
+template <class Tree>
+bool write_combiner<Tree>::publish(op_kind op, const Key& key, const Value& value)
+{
+  slot& s = slots[reader_id::self()];
+  s.op = op;
+  s.key = key;
+  s.value = value;
+  s.state.store(PENDING, std::memory_order_release);
+
+  for(int spins = 0; s.state.load(std::memory_order_acquire) != DONE; spins++) {
+    if(!combining.load(std::memory_order_relaxed) &&
+       !combining.exchange(true, std::memory_order_acquire)) {
+      combine();
+      combining.store(false, std::memory_order_release);
+    }
+    else if(spins > 64) {
+      spins = 0;
+      sched_yield();
+    }
+  }
+
+  bool result = s.result;
+  s.state.store(EMPTY, std::memory_order_relaxed);
+  return result;
+}
+
+/**
+ * Applies every pending operation under a single hold
+ * of the write lock: lock in global mode, where the tree
+ * takes none of its own, and the tree's writer lock in every
+ * other mode. Only the thread holding the combiner flag
+ * calls it.
+ */
+template <class Tree>
+void write_combiner<Tree>::combine()
+{
+  if(lock != NULL) lock->begin_write(0);
+  tree->begin_modify(true);
+  RB_COUNT(combines);
+
+  for(int pass = 0; pass < COMBINE_PASSES; pass++) {
+    int readers = reader_id::high_water.load();
+    bool found = false;
+    for(int i = 0; i < readers; i++) {
+      slot& s = slots[i];
+      if(s.state.load(std::memory_order_acquire) != PENDING) continue;
+
+      if(s.op == insert_op) {
+	tree->apply_insert(s.key, s.value);
+	s.result = true;
+      }
+      else if(s.op == delete_op) {
+	tree->apply_erase(s.key, true);
+	s.result = true;
+      }
+      else {
+	s.result = tree->apply_erase(s.key, false);
+      }
+      s.state.store(DONE, std::memory_order_release);
+      RB_COUNT(combined);
+      found = true;
+    }
+    if(!found) break;
+  }
+
+  tree->end_modify();
+  if(lock != NULL) lock->end_write(0);
+}
+
+/**
+ * Inserts the entry through the combiner.
+ */
+template <class Tree>
+void write_combiner<Tree>::insert_node(const Key& key, const Value& value)
+{
+  publish(insert_op, key, value);
+}
+
+/**
+ * Deletes key through the combiner, complaining
+ * like the tree if it is not there.
+ */
+template <class Tree>
+void write_combiner<Tree>::delete_node(const Key& key)
+{
+  publish(delete_op, key, Value());
+}
+
+/**
+ * Deletes key through the combiner if it is there.
+ * RETURNS whether it was.
+ */
+template <class Tree>
+bool write_combiner<Tree>::erase(const Key& key)
+{
+  return publish(erase_op, key, Value());
+}
+
+/**
+ * Searches the tree directly, under the read side
+ * of the lock in global mode.
+ * RETURNS the found node, NULL otherwise.
+ */
+template <class Tree>
+typename write_combiner<Tree>::node_p write_combiner<Tree>::search_tree(const Key& key)
+{
+  if(lock != NULL) lock->begin_read(0);
+  node_p n = tree->search_tree(key);
+  if(lock != NULL) lock->end_read(0);
+  return n;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _FROZEN_INDEX_H
+ # define _FROZEN_INDEX_H
+
+#include <cstddef>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// lookups frozen_index::search walks in lockstep
+#define FROZEN_GROUP 8
+
+/**
+ * A read-only copy of a tree's keys in Eytzinger order: the
+ * keys of a complete binary search tree laid out level by level,
+ * so position i has its children at 2i and 2i + 1. The first
+ * levels share a few cache lines, every step of a search knows
+ * where the next one goes in time to prefetch it, and since the
+ * step is a comparison added to an index, the search never
+ * branches on a key. refs[i] is what keys[i] came from; both
+ * arrays start at 1.
+ */
+template <class Key, class Ref, class Compare = std::less<Key> >
+struct frozen_index {
+  std::vector<Key> keys;
+  std::vector<Ref> refs;
+  size_t n;
+  int levels;     // steps every search takes
+  Compare compare;
+
+  /**
+   * Lays out the n sorted entries that next(key, ref) hands
+   * out one after another.
+   */
+  template <class F>
+  frozen_index(size_t n, F next) : keys(n + 1), refs(n + 1), n(n)
+  {
+    levels = 0;
+    while(((size_t) 1 << levels) <= n) levels++;
+    fill(1, next);
+  }
+
+  /**
+   * Looks up count keys, a group of them in lockstep.
+   * found[j] becomes the ref of keys[j], or none if it is missing.
+   */
+  void search(const Key* lookups, size_t count, Ref* found, Ref none) const
+  {
+    size_t j = 0;
+#ifdef __AVX2__
+    if constexpr(std::is_same<Key, int>::value && std::is_same<Compare, std::less<int> >::value) {
+      if(n < ((size_t) 1 << 29)) {
+	for(; j + 8 <= count; j += 8) search8(lookups + j, found + j, none);
+      }
+    }
+#endif
+    for(; j < count; j += FROZEN_GROUP) {
+      size_t at[FROZEN_GROUP];
+      size_t group = count - j < FROZEN_GROUP ? count - j : FROZEN_GROUP;
+      for(size_t g = 0; g < group; g++) at[g] = 1;
+
+      for(int l = 0; l < levels; l++) {
+	for(size_t g = 0; g < group; g++) {
+	  size_t i = at[g];
+	  // past the last level a search keeps going right, which the final shift undoes
+	  bool right = i > n || compare(keys[i], lookups[j + g]);
+	  at[g] = 2 * i + right;
+	  __builtin_prefetch(&keys[(2 * at[g]) <= n ? 2 * at[g] : n]);
+	}
+      }
+      for(size_t g = 0; g < group; g++) {
+	found[j + g] = resolve(at[g], lookups[j + g], none);
+      }
+    }
+  }
+
+private:
+  /**
+   * Helper function that gives the subtree rooted at position i
+   * its keys in order: left subtree, i, right subtree.
+   */
+  template <class F>
+  void fill(size_t i, F& next)
+  {
+    if(i > n) return;
+    fill(2 * i, next);
+    next(keys[i], refs[i]);
+    fill(2 * i + 1, next);
+  }
+
+  /**
+   * Since passing the first key that is not smaller than the
+   * one it looks for, a search that ended at position i went
+   * left once and right every other time; dropping those steps
+   * finds that key.
+   * RETURNS the ref of key, none if it is not in the index.
+   */
+  Ref resolve(size_t i, const Key& key, Ref none) const
+  {
+    i >>= __builtin_ffsll(~(unsigned long long) i);
+    if(i == 0 || compare(key, keys[i])) return none;
+    return refs[i];
+  }
+
+#ifdef __AVX2__
+  /**
+   * Eight int lookups at once: each step gathers the eight
+   * keys the lookups stand on and compares them in one go.
+   */
+  void search8(const Key* lookups, Ref* found, Ref none) const
+  {
+    const int* base = (const int*) keys.data();
+    __m256i want = _mm256_loadu_si256((const __m256i*) lookups);
+    __m256i i = _mm256_set1_epi32(1);
+    __m256i last = _mm256_set1_epi32((int) n);
+
+    for(int l = 0; l < levels; l++) {
+      // lanes that ran past the last level read position n and go right
+      __m256i outside = _mm256_cmpgt_epi32(i, last);
+      __m256i at = _mm256_min_epi32(i, last);
+      __m256i k = _mm256_i32gather_epi32(base, at, 4);
+      __m256i right = _mm256_or_si256(_mm256_cmpgt_epi32(want, k), outside);
+      i = _mm256_sub_epi32(_mm256_add_epi32(i, i), right);
+    }
+
+    alignas(32) int ends[8];
+    _mm256_store_si256((__m256i*) ends, i);
+    for(int g = 0; g < 8; g++) found[g] = resolve(ends[g], lookups[g], none);
+  }
+#endif
+};
+
+#endif
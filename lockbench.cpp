@@ -0,0 +1,130 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <pthread.h>
+
+#include "rw_lock.h"
+
+using namespace std;
+
+/**
+ * Everything a benchmark thread needs. Each one lives
+ * on its own cache line so the counters don't interfere
+ * with the lock being measured.
+ */
+struct alignas(64) bench_thread {
+  rw_lock* lock;
+  int tid;
+  int write_percent;
+  atomic<bool>* stop;
+  long* shared;
+  long reads;
+  long writes;
+};
+
+/**
+ * Thread function that alternates reads and writes
+ * of a shared counter until told to stop.
+ */
+void* bench_loop(void* arg)
+{
+  bench_thread* t = (bench_thread*) arg;
+  unsigned seed = t->tid + 1;
+  long sink = 0;
+
+  while(!t->stop->load(memory_order_relaxed)) {
+    if((int)(rand_r(&seed) % 100) < t->write_percent) {
+      t->lock->begin_write(t->tid);
+      (*t->shared)++;
+      t->lock->end_write(t->tid);
+      t->writes++;
+    }
+    else {
+      t->lock->begin_read(t->tid);
+      sink += *t->shared;
+      t->lock->end_read(t->tid);
+      t->reads++;
+    }
+  }
+  return (void*) sink;
+}
+
+/**
+ * Runs one lock for the given number of seconds and
+ * prints how many reads and writes got through.
+ */
+void run(string name, rw_lock* lock, int threads, int write_percent, double seconds)
+{
+  vector<bench_thread> data(threads);
+  vector<pthread_t> ids(threads);
+  atomic<bool> stop(false);
+  long shared = 0;
+
+  for(int i = 0; i < threads; i++) {
+    data[i].lock = lock;
+    data[i].tid = i;
+    data[i].write_percent = write_percent;
+    data[i].stop = &stop;
+    data[i].shared = &shared;
+    data[i].reads = data[i].writes = 0;
+  }
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for(int i = 0; i < threads; i++) {
+    pthread_create(&ids[i], NULL, bench_loop, &data[i]);
+  }
+
+  struct timespec ts;
+  ts.tv_sec = (time_t) seconds;
+  ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+  stop.store(true);
+
+  long reads = 0, writes = 0;
+  for(int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    reads += data[i].reads;
+    writes += data[i].writes;
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << left << setw(18) << name << right << fixed << setprecision(2)
+       << setw(12) << (reads + writes) / elapsed / 1e6
+       << setw(12) << reads / elapsed / 1e6
+       << setw(12) << writes / elapsed / 1e6 << endl;
+}
+
+/**
+ * Compares every whole-tree lock under the same load.
+ * Usage: lockbench [threads] [write percent] [seconds]
+ */
+int main(int argc, char* argv[])
+{
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  int write_percent = argc > 2 ? atoi(argv[2]) : 10;
+  double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+
+  if(threads < 1 || threads > MAX_READERS || write_percent < 0 || write_percent > 100) {
+    cout << "Usage: " << argv[0] << " [threads] [write percent] [seconds]" << endl;
+    return 1;
+  }
+
+  cout << threads << " threads, " << write_percent << "% writes, "
+       << seconds << "s per lock" << endl;
+  cout << left << setw(18) << "lock" << right << setw(12) << "Mops/s"
+       << setw(12) << "reads" << setw(12) << "writes" << endl;
+
+  rw_monitor readers(prefer_readers), writers(prefer_writers), ticket(fair);
+  futex_rwlock futex;
+  dist_rwlock distributed;
+
+  run("monitor/readers", &readers, threads, write_percent, seconds);
+  run("monitor/writers", &writers, threads, write_percent, seconds);
+  run("monitor/fair", &ticket, threads, write_percent, seconds);
+  run("futex", &futex, threads, write_percent, seconds);
+  run("distributed", &distributed, threads, write_percent, seconds);
+  return 0;
+}
@@ -0,0 +1,131 @@
+#ifndef _NODE_ARENA_H
+ # define _NODE_ARENA_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+#include "numa_placement.h"
+
+/**
+ * A slab allocator for fixed-size tree nodes. The arena
+ * reserves one contiguous range of address space up front
+ * and commits it a block at a time, so nodes allocated close
+ * together in time also sit close together in memory. Freed
+ * nodes go on a free list and are handed out again before
+ * any new memory is touched.
+ *
+ * The memory is only returned to the system when the arena is
+ * destroyed, so a freed node always stays readable. The arena
+ * is not thread-safe; the tree only allocates from its writers,
+ * which already run one at a time. Bound to a NUMA node, the
+ * reservation takes its pages from that node instead of from
+ * wherever the first writer to touch them happens to run.
+ */
+template <class T>
+class node_arena {
+public:
+  // nodes committed at a time, and the default reservation
+  static const size_t BLOCK_NODES = 4096;
+  static const size_t DEFAULT_CAPACITY = (size_t) 1 << 28;
+
+  node_arena(size_t capacity = DEFAULT_CAPACITY);
+  ~node_arena();
+
+  T* allocate();
+  void deallocate(T* n);
+  bool bind(int node);
+  size_t in_use() { return live; }
+  size_t capacity() { return reserved; }
+private:
+  // size of one slot; a free slot stores the next free slot in place, copied
+  // in and out since a slot of a 20-byte compact node is only 4-byte aligned,
+  // and padding the slots would break the compact links' node arithmetic
+  static const size_t STRIDE = sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*);
+
+  char* base;
+  size_t reserved;
+  size_t used;
+  size_t committed;
+  size_t live;
+  void* free_list;
+
+  node_arena(const node_arena&);
+  node_arena& operator=(const node_arena&);
+};
+
+/**
+ * Reserves room for capacity nodes without committing any of it.
+ */
+template <class T>
+node_arena<T>::node_arena(size_t capacity)
+{
+  used = committed = live = 0;
+  free_list = NULL;
+  reserved = capacity;
+
+  void* p = mmap(NULL, reserved * STRIDE, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(p == MAP_FAILED) throw std::bad_alloc();
+  base = (char*) p;
+}
+
+/**
+ * Releases the whole reservation; nodes are not destructed.
+ */
+template <class T>
+node_arena<T>::~node_arena()
+{
+  munmap(base, reserved * STRIDE);
+}
+
+/**
+ * RETURNS uninitialized storage for one node, reusing a
+ * freed slot if there is one.
+ */
+template <class T>
+T* node_arena<T>::allocate()
+{
+  live++;
+  if(free_list != NULL) {
+    void* slot = free_list;
+    memcpy(&free_list, slot, sizeof(void*));
+    return (T*) slot;
+  }
+
+  if(used == committed) {
+    size_t grow = reserved - committed < BLOCK_NODES ? reserved - committed : BLOCK_NODES;
+    if(grow == 0 ||
+       mprotect(base + committed * STRIDE, grow * STRIDE, PROT_READ | PROT_WRITE) != 0) {
+      live--;
+      throw std::bad_alloc();
+    }
+    committed += grow;
+  }
+  return (T*) (base + STRIDE * used++);
+}
+
+/**
+ * Puts a node's storage back on the free list.
+ */
+template <class T>
+void node_arena<T>::deallocate(T* n)
+{
+  live--;
+  memcpy((void*) n, &free_list, sizeof(void*));
+  free_list = n;
+}
+
+/**
+ * Places the whole reservation on a NUMA node, moving the nodes
+ * already committed, see bind_to_node.
+ * RETURNS whether the kernel took the policy.
+ */
+template <class T>
+bool node_arena<T>::bind(int node)
+{
+  return bind_to_node(base, reserved * STRIDE, node, committed > 0);
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef _NUMA_PLACEMENT_H
+ # define _NUMA_PLACEMENT_H
+
+#include <cstdio>
+#include <cstddef>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// mbind's policy and flag, spelled out so the build needs no libnuma
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+// highest node count mbind is told about
+#define NUMA_MAX_NODES 64
+
+/**
+ * The machine's NUMA nodes and the CPUs of each one that
+ * this process may run on, read once from sysfs. A machine
+ * without NUMA, or one whose sysfs cannot be read, looks
+ * like a single node 0 holding every allowed CPU. The nodes
+ * are numbered from 0 to nodes() - 1 here; node_id gives the
+ * kernel's own number, which mbind wants and which differs
+ * once memory-only or offline nodes have been skipped.
+ */
+class numa_topology {
+public:
+  static const numa_topology& get();
+
+  int nodes() const { return cpus.size(); }
+  const std::vector<int>& node_cpus(int node) const { return cpus[node % cpus.size()]; }
+  int node_id(int node) const { return ids[node % ids.size()]; }
+  int node_index(int id) const;
+  std::vector<int> spread() const;
+  int node_of_cpu(int cpu) const;
+private:
+  std::vector<std::vector<int> > cpus;
+  std::vector<int> ids;  // the kernel's number of each node in cpus
+
+  numa_topology();
+  static std::vector<int> parse_cpulist(const char* path);
+};
+
+/**
+ * RETURNS the topology, read on first use.
+ */
+inline const numa_topology& numa_topology::get()
+{
+  static numa_topology topology;
+  return topology;
+}
+
+/**
+ * Reads every node's cpulist, keeping only the CPUs in
+ * this process's affinity mask and dropping nodes left
+ * without any, such as memory-only ones.
+ */
+inline numa_topology::numa_topology()
+{
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+  for(int node = 0; node < NUMA_MAX_NODES; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    std::vector<int> list = parse_cpulist(path);
+    std::vector<int> mine;
+    for(unsigned i = 0; i < list.size(); i++) {
+      if(!masked || CPU_ISSET(list[i], &allowed)) mine.push_back(list[i]);
+    }
+    if(!mine.empty()) {
+      cpus.push_back(mine);
+      ids.push_back(node);
+    }
+  }
+
+  if(cpus.empty()) {
+    std::vector<int> all;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int cpu = 0; cpu < (online > 0 ? online : 1); cpu++) {
+      if(!masked || CPU_ISSET(cpu, &allowed)) all.push_back(cpu);
+    }
+    if(all.empty()) all.push_back(0);
+    cpus.push_back(all);
+    ids.push_back(0);
+  }
+}
+
+/**
+ * Helper function that reads a list like "0-3,8-11".
+ * RETURNS the CPUs in it, none if the file is missing.
+ */
+inline std::vector<int> numa_topology::parse_cpulist(const char* path)
+{
+  std::vector<int> list;
+  FILE* f = fopen(path, "r");
+  if(f == NULL) return list;
+
+  int lo, hi;
+  while(fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(f);
+    if(c == '-') {
+      if(fscanf(f, "%d", &hi) != 1) break;
+      c = fgetc(f);
+    }
+    for(int cpu = lo; cpu <= hi; cpu++) list.push_back(cpu);
+    if(c != ',') break;
+  }
+  fclose(f);
+  return list;
+}
+
+/**
+ * RETURNS every allowed CPU, taking one from each node in
+ * turn, so the first few threads pinned in this order land
+ * on different sockets.
+ */
+inline std::vector<int> numa_topology::spread() const
+{
+  std::vector<int> order;
+  for(unsigned k = 0; ; k++) {
+    bool any = false;
+    for(unsigned node = 0; node < cpus.size(); node++) {
+      if(k < cpus[node].size()) {
+	order.push_back(cpus[node][k]);
+	any = true;
+      }
+    }
+    if(!any) break;
+  }
+  return order;
+}
+
+/**
+ * RETURNS the node cpu belongs to, 0 if it is not an allowed CPU.
+ */
+inline int numa_topology::node_of_cpu(int cpu) const
+{
+  for(unsigned node = 0; node < cpus.size(); node++) {
+    for(unsigned i = 0; i < cpus[node].size(); i++) {
+      if(cpus[node][i] == cpu) return node;
+    }
+  }
+  return 0;
+}
+
+/**
+ * RETURNS where the kernel's node id is in the topology,
+ * -1 if it is not one of the nodes with allowed CPUs.
+ */
+inline int numa_topology::node_index(int id) const
+{
+  for(unsigned node = 0; node < ids.size(); node++) {
+    if(ids[node] == id) return node;
+  }
+  return -1;
+}
+
+/**
+ * Pins thread to a single CPU.
+ * RETURNS whether the system let it.
+ */
+inline bool pin_thread(pthread_t thread, int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+/**
+ * Asks for the pages of [addr, addr + len) to come from node,
+ * the kernel's number for it, see numa_topology::node_id;
+ * falling back to other nodes when it is full; pages that are
+ * already there are moved if move is set. addr has to be page
+ * aligned. A kernel without NUMA support refuses, which leaves
+ * the pages wherever first touch puts them.
+ * RETURNS whether the policy was applied.
+ */
+inline bool bind_to_node(void* addr, size_t len, int node, bool move = false)
+{
+  if(node < 0 || node >= NUMA_MAX_NODES) return false;
+  unsigned long mask = 1UL << node;
+  return syscall(SYS_mbind, addr, len, NUMA_MPOL_PREFERRED, &mask,
+		 (unsigned long) NUMA_MAX_NODES + 1, move ? NUMA_MPOL_MF_MOVE : 0) == 0;
+}
+
+#endif
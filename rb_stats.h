@@ -0,0 +1,244 @@
+#ifndef _RB_STATS_H
+ # define _RB_STATS_H
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * Counts latencies in buckets that are a sixteenth of a
+ * power of two wide, so every percentile it reports is
+ * within about 6% of the real one and recording a sample
+ * costs one increment.
+ */
+struct latency_histogram {
+  static const int SUB_BUCKETS = 16;
+  static const int BUCKETS = 64 * SUB_BUCKETS;
+
+  long counts[BUCKETS];
+  long total;
+  unsigned long max;
+
+  latency_histogram()
+  {
+    for(int i = 0; i < BUCKETS; i++) counts[i] = 0;
+    total = 0;
+    max = 0;
+  }
+
+  void add(unsigned long ns)
+  {
+    counts[bucket(ns)]++;
+    total++;
+    if(ns > max) max = ns;
+  }
+
+  void merge(const latency_histogram& other)
+  {
+    for(int i = 0; i < BUCKETS; i++) counts[i] += other.counts[i];
+    total += other.total;
+    if(other.max > max) max = other.max;
+  }
+
+  /**
+   * RETURNS the smallest latency of the bucket that
+   * holds the p-th percentile, 0 if nothing was recorded.
+   */
+  unsigned long percentile(double p)
+  {
+    long want = (long) ceil(total * p / 100.0);
+    long seen = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if(seen >= want && seen > 0) return lowest(i);
+    }
+    return 0;
+  }
+
+private:
+  static int bucket(unsigned long ns)
+  {
+    if(ns < SUB_BUCKETS) return ns;
+    int e = 63 - __builtin_clzl(ns);
+    return (e - 3) * SUB_BUCKETS + ((ns >> (e - 4)) & (SUB_BUCKETS - 1));
+  }
+
+  static unsigned long lowest(int i)
+  {
+    if(i < SUB_BUCKETS) return i;
+    int e = i / SUB_BUCKETS + 3;
+    return (unsigned long) (SUB_BUCKETS + i % SUB_BUCKETS) << (e - 4);
+  }
+};
+
+// the two sides of a reader-writer lock, for indexing rb_stats
+enum lock_side { read_side, write_side };
+
+/**
+ * Counters for the hot paths of the tree and of the whole-tree
+ * lock. Every thread bumps its own copy, so counting never
+ * shares a cache line; total() adds them all up. The counters
+ * are only compiled in with -DRB_STATS, otherwise the macros
+ * below expand to nothing.
+ */
+struct alignas(64) rb_stats {
+  unsigned long rotations;
+  unsigned long recolors;      // fix-up steps that only recolor
+  unsigned long retries;       // optimistic searches that had to start over
+  unsigned long locks[2];      // times the lock was acquired
+  unsigned long sleeps[2];     // times a thread blocked on the lock
+  unsigned long wait_ns[2];    // from asking for the lock to getting it
+  unsigned long hold_ns[2];    // from getting the lock to releasing it
+  unsigned long held_since;
+  unsigned long combines;      // write lock holds taken by a combiner
+  unsigned long combined;      // operations applied by a combiner
+
+  rb_stats() { clear(); }
+
+  void clear()
+  {
+    rotations = recolors = retries = held_since = combines = combined = 0;
+    for(int s = 0; s < 2; s++) {
+      locks[s] = sleeps[s] = wait_ns[s] = hold_ns[s] = 0;
+    }
+  }
+
+  void merge(const rb_stats& other)
+  {
+    rotations += other.rotations;
+    recolors += other.recolors;
+    retries += other.retries;
+    combines += other.combines;
+    combined += other.combined;
+    for(int s = 0; s < 2; s++) {
+      locks[s] += other.locks[s];
+      sleeps[s] += other.sleeps[s];
+      wait_ns[s] += other.wait_ns[s];
+      hold_ns[s] += other.hold_ns[s];
+    }
+  }
+
+  static unsigned long now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /**
+   * Records that the calling thread got side of the
+   * lock, having asked for it at time asked.
+   */
+  void acquired(lock_side side, unsigned long asked)
+  {
+    held_since = now();
+    locks[side]++;
+    wait_ns[side] += held_since - asked;
+  }
+
+  void released(lock_side side)
+  {
+    hold_ns[side] += now() - held_since;
+  }
+
+  static rb_stats& local();
+  static rb_stats total();
+  static void reset();
+
+private:
+  /**
+   * Keeps a thread's counters on the list total() walks and
+   * folds them into the counters of exited threads when the
+   * thread goes away.
+   */
+  struct registration {
+    rb_stats* mine;
+    registration();
+    ~registration();
+  };
+
+  static inline pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static inline std::vector<rb_stats*> threads;
+  static rb_stats exited;
+};
+
+inline rb_stats rb_stats::exited;
+
+inline rb_stats::registration::registration()
+{
+  mine = new rb_stats();
+  pthread_mutex_lock(&lock);
+  threads.push_back(mine);
+  pthread_mutex_unlock(&lock);
+}
+
+inline rb_stats::registration::~registration()
+{
+  pthread_mutex_lock(&lock);
+  exited.merge(*mine);
+  for(unsigned i = 0; i < threads.size(); i++) {
+    if(threads[i] == mine) {
+      threads[i] = threads.back();
+      threads.pop_back();
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  delete mine;
+}
+
+/**
+ * RETURNS the calling thread's counters.
+ */
+inline rb_stats& rb_stats::local()
+{
+  static thread_local registration r;
+  return *r.mine;
+}
+
+/**
+ * RETURNS the sum of the counters of every thread, live or
+ * exited. The live threads should be idle, or the sum is
+ * only approximate.
+ */
+inline rb_stats rb_stats::total()
+{
+  rb_stats sum;
+  pthread_mutex_lock(&lock);
+  sum.merge(exited);
+  for(unsigned i = 0; i < threads.size(); i++) {
+    sum.merge(*threads[i]);
+  }
+  pthread_mutex_unlock(&lock);
+  return sum;
+}
+
+/**
+ * Zeroes every thread's counters; only safe
+ * while no thread is counting.
+ */
+inline void rb_stats::reset()
+{
+  pthread_mutex_lock(&lock);
+  exited.clear();
+  for(unsigned i = 0; i < threads.size(); i++) {
+    threads[i]->clear();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+#ifdef RB_STATS
+# define RB_COUNT(field) (rb_stats::local().field++)
+# define RB_LOCK_ASKED(var) unsigned long var = rb_stats::now()
+# define RB_LOCK_SLEPT(side) (rb_stats::local().sleeps[side]++)
+# define RB_LOCK_ACQUIRED(side, asked) rb_stats::local().acquired(side, asked)
+# define RB_LOCK_RELEASED(side) rb_stats::local().released(side)
+#else
+# define RB_COUNT(field) ((void) 0)
+# define RB_LOCK_ASKED(var) ((void) 0)
+# define RB_LOCK_SLEPT(side) ((void) 0)
+# define RB_LOCK_ACQUIRED(side, asked) ((void) 0)
+# define RB_LOCK_RELEASED(side) ((void) 0)
+#endif
+
+#endif
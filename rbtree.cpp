@@ -6,1209 +6,1059 @@
 #include <chrono>
 #include <pthread.h>
 #include <algorithm>
+#include <getopt.h>
+#include <charconv>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // used to make a colorful command-line user interface
 #include "colors.h"
+#include "thread_pool.h"
+#include "rw_lock.h"
+#include "rbtree.h"
+#include "rb_stats.h"
+#include "flat_combining.h"
+#include "async_tree.h"
+#include "numa_placement.h"
 
 using namespace std;
 
-// enum representing a node's color - red or black (0 or 1)
-enum Color { red, black };
+// the tree the input file describes: a set of int keys
+typedef RBTree<int> int_rbtree;
+typedef write_combiner<int_rbtree> int_combiner;
+typedef async_tree<int_rbtree> int_async;
+typedef rb_tmp_node<int> tmp_node;
+
+// enum representing the operation of an invocation
+enum op_kind { op_search, op_insert, op_delete };
+
+// how each operation is spelled in the input and output files
+const char* op_names[] = { "search", "insert", "delete" };
 
 /**
- * Represents a standard node in a 
- * red-black tree.
+ * RETURNS the operation spelled by the len characters
+ * at name; anything that is not a search or an insert
+ * is taken to be a delete.
  */
-struct node {
-  int key;
-  node* parent;
-  node* left;
-  node* right;
-  bool color;
-
-  node(int key) 
-  { 
-    this->key = key; 
-    left = right = parent = NULL; 
-    this->color = red; 
-  } 
-};
-typedef node* node_p;
+op_kind parse_op_kind(const char* name, size_t len)
+{
+  if(len == 6 && memcmp(name, "search", 6) == 0) return op_search;
+  if(len == 6 && memcmp(name, "insert", 6) == 0) return op_insert;
+  return op_delete;
+}
 
 /**
- * After reading the input file,
- * temporary nodes are created with just a 
- * key and color before being used to create the
- * initial tree.
+ * Where the worker that runs an invocation
+ * leaves its result.
  */
-struct tmp_node {
-  int key;
-  bool color;
+struct op_result {
+  bool found;                                 // searches only
+  long thread_id;
+  chrono::steady_clock::time_point started;   // before waiting for the tree
+  chrono::steady_clock::time_point finished;
 };
-typedef tmp_node* tmp_node_p;
 
 /**
  * Represents the sequences of invocations
  * read in from the input file; each has an 
- * operation (search) and a key (7).
+ * operation (search) and a key (7). Every
+ * invocation fills a cache line of its own, so the
+ * workers writing the results of neighbouring
+ * invocations never touch the same line.
  */
-struct tree_op {
-  string operation;
+struct alignas(64) tree_op {
+  op_kind operation;
   int key;
+  op_result result;
 };
 typedef tree_op* t_op;
 
 /**
  * This is fed into the method that creates the 
  * output file; it represents the results from the 
- * input file.
+ * input file. The result of each search is kept
+ * with the search itself.
  */
 struct results {
   double time;
-  vector<int> search_true;
-  vector<long> search_thread_ids;
   string final_rbt;
+  bool stats;                    // whether the fields below are reported
+  latency_histogram latency[3];  // of every kind of operation, in the last run
+  rb_stats counters;             // only counted with -DRB_STATS
+  long nodes;
+  int height;
+  double depth;                  // average depth of a node in the final tree
 };
 typedef results* results_p;
 
-/**
- * Monitor class for the readers-writers problem
- * that is used to implement concurrency in this project.
- * It includes standard variables and methods associated with
- * a readers-writers problem where readers have priority.
- */
-class rw_monitor {
-private:
-  int num_readers;
-  int num_writers;
-  int readers_wait;
-  int writers_wait;
-
-  pthread_cond_t can_read;
-  pthread_cond_t can_write;
-  pthread_mutex_t cond_lock;
-
-public:
-  rw_monitor()
-  {
-    num_readers = 0;
-    num_writers = 0;
-    readers_wait = 0;
-    writers_wait = 0;
-
-    pthread_cond_init(&can_read, NULL); 
-    pthread_cond_init(&can_write, NULL); 
-    pthread_mutex_init(&cond_lock, NULL);
-  }
-
-  /**
-   * This function begins the reading of 
-   * tree data if there is not a writer already
-   * locking the tree. There can be multiple readers.
-   */
-  void begin_read(int reader)
-  {
-    pthread_mutex_lock(&cond_lock);
-    
-    if (num_writers == 1 || writers_wait > 0) { 
-      readers_wait++;
-      
-      pthread_cond_wait(&can_read, &cond_lock); 
-      readers_wait--; 
-    }
-    
-    num_readers++;
-    pthread_mutex_unlock(&cond_lock); 
-    pthread_cond_broadcast(&can_read);
-  }
-
-  /**
-   * This function ends a reader and checks if 
-   * there are any left. If there are none left, 
-   * then any waiting writers can begin inserting/deleting.
-   */
-  void end_read(int reader)
-  {
-    pthread_mutex_lock(&cond_lock); 
-    
-    if (num_readers-- == 0) { 
-      pthread_cond_signal(&can_write);
-    }
-    
-    pthread_mutex_unlock(&cond_lock); 
-  }
-
-  /**
-   * This function begins the inserting/deleting of
-   * the global red-black tree if there are no readers
-   * currently searching the tree.
-   */
-  void begin_write(int writer)
-  {
-    pthread_mutex_lock(&cond_lock); 
-    
-    if (num_writers == 1 || num_readers > 0) { 
-      writers_wait++; 
-      pthread_cond_wait(&can_write, &cond_lock); 
-      writers_wait--; 
-    } 
-    num_writers = 1;
-    pthread_mutex_unlock(&cond_lock); 
-  }
-
-  /**
-   * This function ends a writer and
-   * unblocks any waiting readers so they
-   * can begin their searches of the tree.
-   */
-  void end_write(int writer)
-  {
-    pthread_mutex_lock(&cond_lock); 
-    num_writers = 0; 
-    
-    if (readers_wait > 0) { 
-      pthread_cond_signal(&can_read);
-    }
-    else {
-      pthread_cond_signal(&can_write);
-    }
-    pthread_mutex_unlock(&cond_lock);
-  }
-};
-
-/**
- * This class represents a red black tree.
- * It includes functions for inserting, deleting,
- * searching, and printing the tree in different ways.
- */
-class RBTree {
-public:
-  RBTree() { root = NULL; }
-  RBTree(vector<tmp_node_p> t_rbt)
-  {
-    tmp_tree = t_rbt;
-    root = NULL;
-  }
-
-  void build_tree();
-  void insert_node(int key);
-  void delete_node(int key);
-  node_p search_tree(int key);
-  void* search_thread(void* key);
-  node_p get_root() { return root; }
-  void in_order();
-  void level_order();
-  void prefix_order();
-  void print_tree();
-  string get_prefix_tree();
-private:
-  node_p root;
-  tmp_node_p last;
-  vector<tmp_node_p> tmp_tree;
-  string prefix_tree;
-  
-  node_p insert_helper(node_p root, node_p node);
-  node_p build_tree_helper(node_p root, tmp_node_p curr);
-  void fix_insert(node_p& root, node_p& node);
-  void fix_double_black(node_p node);
-  void rotate_right(node_p& root, node_p& node);
-  void rotate_left(node_p& root, node_p& node);
-  void in_order_helper(node_p root);
-  void prefix_order_helper(node_p root);
-  void level_order_helper(node_p root);
-  void delete_helper(node_p node);
-  void print_tree_helper(node_p root, string delimiter, bool last);
-  node_p search_helper(node_p node, int key);
-  node_p min(node_p node);
-  node_p replace(node_p node);
-  bool is_on_left(node_p node);
-  node_p sibling(node_p node);
-  bool red_child(node_p node);
-  void swap_keys(node_p u, node_p v);
-};
-
 /**
  * This is the struct that is 
  * passed into the thread functions since
  * they can accept only one argument.
  */
 struct thread_data {
-  RBTree rbt;
+  int_rbtree* rbt;
   t_op op;
   results_p results;
   int tid;
+  vector<int> batch;   // keys of a batched run of op->operation, if any
+  t_op* run;           // the invocations of the job, run[0] == op
 };
 typedef thread_data* t_data;
 
 /**
- * Helper function that prints out the tree
- * in a skeleton-like manner showing the connections
- * between all nodes.
+ * Class representing all the input/output
+ * procedures of the project. This includes 
+ * functions for readind the input file and creating
+ * the output file, as well as parsing.
  */
-void RBTree::print_tree_helper(node_p root, string delimiter, bool last)
-{
-  if(root != NULL) {
-    cout << delimiter;
-
-    if(last) {
-      cout << "R----";
-      delimiter += "    ";
-    }
-    else {
-      cout << "L----";
-      delimiter += "|   ";
-    }
+class IO {
+public:
+  vector<tmp_node> tree;
+  vector<int> worker_threads;
+  vector<tree_op> ops;
+  vector<t_op> searchers;
+  vector<t_op> modifiers;
+  vector<t_op> invocations;
 
-    string c = root->color ? "BLACK" : "RED";
-    cout << root->key << "(" << c << ")" << endl;
-    print_tree_helper(root->left, delimiter, false);
-    print_tree_helper(root->right, delimiter, true);
-  }
-}
+  void parse_tree_line(const char* p, const char* end, int_rbtree* rbt);
+  void parse_thread_lines(const char* p, const char* end);
+  void parse_invocation_lines(const char* p, const char* end);
+  void parse_input_file(string filename, int_rbtree* rbt = NULL);
+  void write_output(string output_filename, results_p results);
+  void write_stats_json(string filename, results_p results);
+  void collect_stats(int_rbtree* rbt, results_p results);
+private:
+  void malformed(const char* what);
+};
 
 /**
- * Helper function for printing out the 
- * tree in an in-order fashion.
+ * Reports an input file that cannot be parsed and exits.
  */
-void RBTree::in_order_helper(node_p root)
+void IO::malformed(const char* what)
 {
-  if(root == NULL) return;
-
-  in_order_helper(root->left);
-  cout << root->key << " ";
-  in_order_helper(root->right);
+  cout << "Error: malformed " << what << " in the input file!" << endl;
+  exit(1);
 }
 
 /**
- * Helper function for printing out 
- * the tree in a level-order fashion.
+ * Parses the first line of the input file
+ * containing the tree in prefix order. Every node
+ * goes straight to rbt, if there is one, and into
+ * tree otherwise.
  */
-void RBTree::level_order_helper(node_p root)
+void IO::parse_tree_line(const char* p, const char* end, int_rbtree* rbt)
 {
-  if(root == NULL) return;
-  
-  queue<node_p> q;
-  q.push(root);
-
-  while(!q.empty()) {
-    node_p temp = q.front();
-    cout << temp->key << " ";
-    q.pop();
-
-    if(temp->left != NULL) {
-      q.push(temp->left);
-    }
-    if(temp->right != NULL) {
-      q.push(temp->right);
-    }
+  if(rbt == NULL) {
+    tree.reserve(count(p, end, ',') + 1);
   }
-}
 
-/**
- * Used to get the final red-black tree string.
- * RETURNS the final red-black tree in prefix order 
- * as a string 
- */
-string RBTree::get_prefix_tree()
-{
-  return prefix_tree;
-}
+  while(p < end) {
+    while(p < end && (*p == ',' || isspace((unsigned char) *p))) p++;
+    if(p == end) break;
 
-/**
- * Helper function for building the final red
- * black tree in prefix order as a string.
- */
-void RBTree::prefix_order_helper(node_p node)
-{
-  if(node == NULL) return;
-  char c = node->color ? 'b' : 'r';
-  prefix_tree += to_string(node->key) + c + ",";
-  if(node->left == NULL) prefix_tree += "f,";
-  if(node->right == NULL && last->key != node->key) prefix_tree += "f,";
-
-  prefix_order_helper(node->left);
-  prefix_order_helper(node->right);
-}
-
-/**
- * Prints out the tree in-order.
- */
-void RBTree::in_order()
-{
-  in_order_helper(root);
-}
-
-/**
- * Prints out the tree in level-order.
- */
-void RBTree::level_order()
-{
-  level_order_helper(root);
-}
+    // the tree is rebuilt from the keys alone, so null markers are dropped
+    if(*p == 'f') {
+      p++;
+      continue;
+    }
 
-/**
- * Builds the final red-black tree as a string
- * in prefix order.
- */
-void RBTree::prefix_order() {
-  prefix_tree = "";
-  prefix_order_helper(root);
-}
+    tmp_node n;
+    from_chars_result res = from_chars(p, end, n.key);
+    if(res.ec != errc()) malformed("tree");
+    p = res.ptr;
+    n.color = p < end && *p == 'r' ? red : black;
+    while(p < end && *p != ',') p++;
 
-/**
- * Helper function used to insert a node into the tree.
- * RETURNS the root of the tree.
- */
-node_p RBTree::insert_helper(node_p root, node_p node)
-{
-  if(root == NULL) return node;
-
-  if(node->key < root->key) {
-    root->left = insert_helper(root->left, node);
-    root->left->parent = root;
-  }
-  else if(node->key > root->key) {
-    root->right = insert_helper(root->right, node);
-    root->right->parent = root;
+    if(rbt != NULL) {
+      if(!rbt->build_push(n.key, n.color)) malformed("tree");
+    }
+    else tree.push_back(n);
   }
-
-  return root;
+  if(rbt != NULL) rbt->build_finish();
 }
 
 /**
- * Fixes any inconsistencies caused by deleting a node
- * from the tree.
+ * Parses the thread lines that contain the 
+ * number of search and modify threads.
  */
-void RBTree::fix_double_black(node_p node)
+void IO::parse_thread_lines(const char* p, const char* end)
 {
-  if(node == root) return;
-
-  node_p sib = sibling(node), parent = node->parent;
-  if(sib == NULL) {
-    fix_double_black(parent);
-  }
-  else {
-    if(sib->color == red) {
-      parent->color = red;
-      sib->color = black;
-      if(is_on_left(sib)) {
-	rotate_right(root, parent);
-      }
-      else {
-	rotate_left(root, parent);
-      }
-      fix_double_black(node);
-    }
-    else {
-      if(red_child(sib)) {
-	if(sib->left != NULL && sib->left->color == red) {
-	  if(is_on_left(sib)) {
-	    sib->left->color = sib->color;
-	    sib->color = parent->color;
-	    rotate_right(root, parent);
-	  }
-	  else {
-	    sib->left->color = parent->color;
-	    rotate_right(root, sib);
-	    rotate_left(root, parent);
-	  }
-	}
-	else {
-	  if(is_on_left(sib)) {
-	    sib->right->color = parent->color;
-	    rotate_left(root, sib);
-	    rotate_right(root, parent);
-	  }
-	  else {
-	    sib->right->color = sib->color;
-	    sib->color = parent->color;
-	    rotate_left(root, parent);
-	  }
-	}
-	parent->color = black;
+  int search = 0;
+  int modify = 0;
+  
+  while(p < end) {
+    const char* eol = (const char*) memchr(p, '\n', end - p);
+    if(eol == NULL) eol = end;
+
+    // e.g. "Search threads: 4"; the count is the last word of the line
+    const char* last = eol;
+    while(last > p && isspace((unsigned char) last[-1])) last--;
+    const char* num = last;
+    while(num > p && isdigit((unsigned char) num[-1])) num--;
+
+    if(num < last) {
+      int n = 0;
+      from_chars(num, last, n);
+      if(last - p >= 6 && strncasecmp(p, "search", 6) == 0) {
+	search = n;
       }
       else {
-	sib->color = red;
-	if(parent->color == black) {
-	  fix_double_black(parent);
-	}
-	else {
-	  parent->color = black;
-	}
+	modify = n;
       }
     }
+    p = eol + 1;
   }
-}
 
-/**
- * RETURNS true if node has a red child, false otherwise.
- */
-bool RBTree::red_child(node_p node)
-{
-  return (node->left != NULL && node->left->color == red) ||
-    (node->right != NULL && node->right->color == red);
-}
-
-/**
- * RETURNS true if node is on the 
- * left side of its parent, false otherwise.
- */
-bool RBTree::is_on_left(node_p node)
-{
-  return node == node->parent->left;
+  worker_threads.assign(1, search);
+  worker_threads.push_back(modify);
 }
 
 /**
- * RETURNS the node's sibling if 
- * it has one, NULL node otherwise.
+ * Parses the invocation lines that contain
+ * all the search, insert, and delete operations
+ * that will be perfomed on the tree. Every
+ * invocation is stored in ops; the other three
+ * lists point into it.
  */
-node_p RBTree::sibling(node_p node)
+void IO::parse_invocation_lines(const char* p, const char* end)
 {
-  if(node->parent == NULL) {
-    return NULL;
-  }
-  if(is_on_left(node)) {
-    return node->parent->right;
+  ops.reserve(count(p, end, '('));
+
+  while(p < end) {
+    const char* open = (const char*) memchr(p, '(', end - p);
+    if(open == NULL) break;
+
+    // the operation is the word right in front of the parenthesis
+    const char* name = open;
+    while(name > p && isalpha((unsigned char) name[-1])) name--;
+
+    tree_op op = tree_op();
+    op.operation = parse_op_kind(name, open - name);
+    from_chars_result res = from_chars(open + 1, end, op.key);
+    if(res.ec != errc()) malformed("invocation");
+    ops.push_back(op);
+    p = res.ptr;
   }
-  return node->parent->left;
-}
 
-/**
- * RETURNS the min node of the tree.
- */
-node_p RBTree::min(node_p node)
-{
-  node_p tmp = node;
-  while(tmp->left != NULL) {
-    tmp = tmp->left;
+  for(unsigned i = 0; i < ops.size(); i++) {
+    if(ops[i].operation == op_search) searchers.push_back(&ops[i]);
+    else modifiers.push_back(&ops[i]);
+    invocations.push_back(&ops[i]);
   }
-
-  return tmp;
 }
 
 /**
- * Function for swapping the keys
- * of two nodes.
+ * Parent parser function that calls upon 
+ * the above three to parse the input file.
+ * The file is mapped into memory and read in a
+ * single pass; its sections are separated by
+ * blank lines.
  */
-void RBTree::swap_keys(node_p u, node_p v)
+void IO::parse_input_file(string filename, int_rbtree* rbt)
 {
-  int tmp;
-  tmp = u->key;
-  u->key = v->key;
-  v->key = tmp;
-}
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
 
-/**
- * This function finds the node that is
- * to replace the deleted node in the tree.
- * RETURNS the node that will replace the node 
- * to be deleted in the tree
- */
-node_p RBTree::replace(node_p node)
-{
-  if(node->left != NULL && node->right != NULL) {
-    return min(node->right);
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    cout << "Error: unable to open input file!" << endl;
+    exit(1);
   }
-  if(node->left == NULL && node->right == NULL) {
-    return NULL;
+
+  void* map = MAP_FAILED;
+  if(st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+      cout << "Error: unable to open input file!" << endl;
+      exit(1);
+    }
   }
-  if(node->left != NULL) {
-    return node->left;
+  close(fd);
+
+  const char* data = map == MAP_FAILED ? "" : (const char*) map;
+  const char* end = data + (map == MAP_FAILED ? 0 : st.st_size);
+
+  // the tree, the thread lines, and then everything left is invocations
+  const char* start[3] = { data, end, end };
+  const char* stop[3] = { end, end, end };
+  int section = 0;
+  for(const char* line = data; line < end && section < 2; ) {
+    const char* eol = (const char*) memchr(line, '\n', end - line);
+    if(eol == NULL) eol = end;
+    if(eol == line || (eol == line + 1 && *line == '\r')) {
+      stop[section] = line;
+      start[++section] = eol < end ? eol + 1 : end;
+    }
+    line = eol < end ? eol + 1 : end;
   }
-  else {
-    return node->right;
+
+  parse_tree_line(start[0], stop[0], rbt);
+  parse_thread_lines(start[1], stop[1]);
+  parse_invocation_lines(start[2], stop[2]);
+
+  if(map != MAP_FAILED) {
+    munmap(map, st.st_size);
   }
 }
 
 /**
- * Deletes a node from the tree 
- * with the given key.
+ * Creates the output file and writes it to disk.
+ * The output includes the overall execution time
+ * of all the invocations, the results from all the searches,
+ * and the final red black tree in prefix order.
  */
-void RBTree::delete_helper(node_p n)
+void IO::write_output(string output_filename, results_p r)
 {
-  node_p m = replace(n);
-
-  bool bb = ((m == NULL || m->color == black) && (n->color == black));
-  node_p parent = n->parent;
+  ofstream file(output_filename);
 
-  if(m == NULL) {
-    if(n == root) {
-      root = NULL;
-    }
-    else {
-      if(bb) {
-	fix_double_black(n);
-      }
-      else {
-	if(sibling(n) != NULL) {
-	  sibling(n)->color = red;
-	}
-      }
+  if(file.is_open()) {
+    file << "Execution time: " << endl;
+    file << r->time << " seconds" << endl;
+    file << endl;
 
-      if(is_on_left(n)) {
-	parent->left = NULL;
+    if(r->stats) {
+      file << "Statistics: " << endl;
+      for(int k = op_search; k <= op_delete; k++) {
+	latency_histogram& h = r->latency[k];
+	file << op_names[k] << ": " << h.total << " ops, latency p50 " << h.percentile(50)
+	     << " ns, p90 " << h.percentile(90) << " ns, p99 " << h.percentile(99)
+	     << " ns, max " << h.max << " ns" << endl;
       }
-      else {
-	parent->right = NULL;
+      file << "tree: " << r->nodes << " nodes, height " << r->height
+	   << ", average depth " << r->depth << endl;
+#ifdef RB_STATS
+      const char* sides[] = { "reads", "writes" };
+      file << "rotations: " << r->counters.rotations << ", recolors: " << r->counters.recolors
+	   << ", search retries: " << r->counters.retries << endl;
+      file << "combining: " << r->counters.combines << " lock holds, "
+	   << r->counters.combined << " operations" << endl;
+      for(int s = read_side; s <= write_side; s++) {
+	file << sides[s] << ": " << r->counters.locks[s] << " locks, " << r->counters.sleeps[s]
+	     << " sleeps, " << r->counters.wait_ns[s] << " ns waiting, "
+	     << r->counters.hold_ns[s] << " ns held" << endl;
       }
+#endif
+      file << endl;
     }
-    delete n;
-    return;
-  }
 
-  if(n->left == NULL || n->right == NULL) {
-    if(n == root) {
-      n->key = m->key;
-      n->left = n->right = NULL;
-      delete m;
+    // everything else is put together in one buffer and written at once
+    string out;
+    out.reserve(searchers.size() * 64 + r->final_rbt.size() + 64);
+    out += "Search output: \n";
+
+    char num[24];
+    for(unsigned i = 0; i < searchers.size(); i++) {
+      out += op_names[searchers[i]->operation];
+      out += '(';
+      out.append(num, to_chars(num, num + sizeof(num), searchers[i]->key).ptr);
+      out += searchers[i]->result.found ? ")->true" : ")->false";
+      out += ", performed by thread: ";
+      out.append(num, to_chars(num, num + sizeof(num), searchers[i]->result.thread_id).ptr);
+      out += '\n';
     }
-    else {
-      if(is_on_left(n)) {
-	parent->left = m;
-      }
-      else {
-	parent->right = m;
-      }
-      delete n;
+    out += "\nFinal Red-Black Tree: \n";
+    out += r->final_rbt;
+    out += '\n';
 
-      m->parent = parent;
-      if(bb) {
-	fix_double_black(m);
-      }
-      else {
-	m->color = black;
-      }
-    }
-    return;
+    file.write(out.data(), out.size());
+    file.close();
+  }
+  else {
+    cout << "Error: unable to open file!" << endl;
+    exit(1);
   }
-
-  swap_keys(m, n);
-  delete_helper(m);
 }
 
 /**
- * Helper function that perfoms a binary search of the 
- * red-black tree to try and find the node with the given key.
- * RETURNS the found node, NULL otherwise.
+ * Writes the statistics of the last run to
+ * filename as a single JSON object.
  */
-node_p RBTree::search_helper(node_p node, int key)
+void IO::write_stats_json(string filename, results_p r)
 {
-  if(node == NULL || key == node->key) {
-    return node;
-  }
+  ofstream file(filename);
 
-  if(key < node->key) {
-    return search_helper(node->left, key);
+  if(!file.is_open()) {
+    cout << "Error: unable to open file!" << endl;
+    exit(1);
   }
 
-  return search_helper(node->right, key);
+  file << "{\"time\": " << r->time << ", \"ops\": {";
+  for(int k = op_search; k <= op_delete; k++) {
+    latency_histogram& h = r->latency[k];
+    file << (k == op_search ? "" : ", ") << '"' << op_names[k] << "\": {\"count\": " << h.total
+	 << ", \"p50_ns\": " << h.percentile(50) << ", \"p90_ns\": " << h.percentile(90)
+	 << ", \"p99_ns\": " << h.percentile(99) << ", \"max_ns\": " << h.max << "}";
+  }
+  file << "}, \"tree\": {\"nodes\": " << r->nodes << ", \"height\": " << r->height
+       << ", \"average_depth\": " << r->depth;
+#ifdef RB_STATS
+  file << ", \"rotations\": " << r->counters.rotations
+       << ", \"recolors\": " << r->counters.recolors << ", \"search_retries\": "
+       << r->counters.retries << "}, \"combining\": {\"holds\": "
+       << r->counters.combines << ", \"operations\": " << r->counters.combined << "}, \"lock\": {";
+  const char* sides[] = { "read", "write" };
+  for(int s = read_side; s <= write_side; s++) {
+    file << (s == read_side ? "" : ", ") << '"' << sides[s] << "\": {\"locks\": " << r->counters.locks[s]
+	 << ", \"sleeps\": " << r->counters.sleeps[s] << ", \"wait_ns\": " << r->counters.wait_ns[s]
+	 << ", \"hold_ns\": " << r->counters.hold_ns[s] << "}";
+  }
+#endif
+  file << "}}" << endl;
 }
 
 /**
- * Rotates the tree right if there is inconsistencies
- * in the structural integrity of the red-black tree.
+ * Helper function that adds up the number of nodes and
+ * their depths below n, which sits at the given depth,
+ * and raises height to the deepest level found.
  */
-void RBTree::rotate_right(node_p& root, node_p& node)
+void measure_tree(int_rbtree::node_p n, int depth, long& nodes, long& depths, int& height)
 {
-  node_p left = node->left;
-  node->left = left->right;
-
-  if(node->left != NULL) {
-    node->left->parent = node;
-  }
-
-  left->parent = node->parent;
-
-  if(node->parent == NULL) {
-    root = left;
-  }
-  else if(node == node->parent->left) {
-    node->parent->left = left;
-  }
-  else {
-    node->parent->right = left;
-  }
-
-  left->right = node;
-  node->parent = left;
+  if(n == NULL) return;
+  nodes++;
+  depths += depth;
+  if(depth + 1 > height) height = depth + 1;
+  measure_tree(n->left(), depth + 1, nodes, depths, height);
+  measure_tree(n->right(), depth + 1, nodes, depths, height);
 }
 
 /**
- * Rotates the tree left if there is inconsistencies
- * in the structural integrity of the red-black tree.
+ * Fills in the statistics of the run that just finished:
+ * the latency of every invocation, the counters of every
+ * thread, and the shape of the final tree.
  */
-void RBTree::rotate_left(node_p& root, node_p& node)
+void IO::collect_stats(int_rbtree* rbt, results_p r)
 {
-  node_p right = node->right;
-  node->right = right->left;
-
-  if(node->right != NULL) {
-    node->right->parent = node;
+  for(int k = op_search; k <= op_delete; k++) {
+    r->latency[k] = latency_histogram();
   }
-
-  right->parent = node->parent;
-
-  if(node->parent == NULL) {
-    root = right;
-  }
-  else if(node == node->parent->left) {
-    node->parent->left = right;
-  }
-  else {
-    node->parent->right = right;
+  for(unsigned i = 0; i < ops.size(); i++) {
+    op_result& res = ops[i].result;
+    r->latency[ops[i].operation].add(chrono::duration_cast<chrono::nanoseconds>(res.finished - res.started).count());
   }
+  r->counters = rb_stats::total();
 
-  right->left = node;
-  node->parent = right;
+  long depths = 0;
+  r->nodes = 0;
+  r->height = 0;
+  measure_tree(rbt->get_root(), 0, r->nodes, depths, r->height);
+  r->depth = r->nodes > 0 ? (double) depths / r->nodes : 0;
 }
 
 /**
- * Helper function used to re-balance the 
- * tree after an insert.
+ * Thread function that searches the tree
+ * for a node with a given key.
  */
-void RBTree::fix_insert(node_p& root, node_p& node)
+void* search_thread(void* thread_data)
 {
-  node_p parent = NULL;
-  node_p grand_parent = NULL;
-
-  while((node != root) && (node->color != black) &&
-	(node->parent->color == red)) {
-    parent = node->parent;
-    grand_parent = node->parent->parent;
-
-    if(parent == grand_parent->left) {
-      node_p uncle = grand_parent->right;
-
-      if(uncle != NULL && uncle->color == red) {
-	grand_parent->color = red;
-	parent->color = black;
-	uncle->color = black;
-	node = grand_parent;
-      }
-      else {
-	if(node == parent->right) {
-	  rotate_left(root, parent);
-	  node = parent;
-	  parent = node->parent;
-	}
-
-	rotate_right(root, grand_parent);
-	parent->color = black;
-	grand_parent->color = red;
-	node = parent;
-      }
-    }
-    else {
-      node_p uncle = grand_parent->left;
-
-      if((uncle != NULL) && (uncle->color == red)) {
-	grand_parent->color = red;
-	parent->color = black;
-	uncle->color = black;
-	node = grand_parent;
-      }
-      else {
-	if(node == parent->left) {
-	  rotate_right(root, parent);
-	  node = parent;
-	  parent = node->parent;
-	}
-
-	rotate_left(root, grand_parent);
-	parent->color = black;
-	grand_parent->color = red;
-	node = parent;
-      }
-    }
-  }
-
-  root->color = black;
+  t_data data;
+  data = (t_data) thread_data;
+  data->op->result.found = data->rbt->search_tree(data->op->key) != NULL;
+  return NULL;
 }
 
 /**
- * Inserts a node with the given key
- * into the tree.
+ * Thread function that inserts a new node
+ * into the tree with a given key.
  */
-void RBTree::insert_node(int key)
+void* insert_thread(void* thread_data)
 {
-  if(search_tree(key) == NULL) {
-    node_p npt = new node(key);
-    
-    root = insert_helper(root, npt);
-    
-    fix_insert(root, npt);
-  }
+  t_data data;
+  data = (t_data) thread_data;
+  data->rbt->insert_node(data->op->key);
+  return NULL;
 }
 
 /**
- * Deletes a node from the tree
- * with the given key.
+ * Thread function that deletes a node
+ * from the tree with a given key.
  */
-void RBTree::delete_node(int key)
+void* delete_thread(void* thread_data)
 {
-  if(root == NULL) return;
+  t_data data;
+  data = (t_data) thread_data;
+  data->rbt->delete_node(data->op->key);
+  return NULL;
+}
 
-  node_p n = search_tree(key);
+// global lock guarding the tree in global_lock mode, chosen in main()
+rw_lock* M = NULL;
 
-  if(n == NULL) {
-    cout << "Error: couldn't find " << key << "in the tree." << endl;
-    return;
+// combiner the writers go through with -c, NULL otherwise
+int_combiner* C = NULL;
+
+/**
+ * Fills in who ran the count invocations of
+ * a job, starting with data->run, and when.
+ */
+void finish_run(t_data data, unsigned count, chrono::steady_clock::time_point started)
+{
+  chrono::steady_clock::time_point finished = chrono::steady_clock::now();
+  for(unsigned i = 0; i < count; i++) {
+    op_result& res = data->run[i]->result;
+    res.thread_id = (long) pthread_self();
+    res.started = started;
+    res.finished = finished;
   }
-  
-  delete_helper(n);
 }
 
 /**
- * Searches the tree for a node
- * with the given key.
+ * Reader function that is used
+ * for concurrent searches to the tree
+ * using monitors.
+ * RETURNS a void pointer
  */
-node_p RBTree::search_tree(int key)
+void* reader(void* reader_data)
 {
-  return search_helper(root, key);
+  t_data data;
+  data = (t_data) reader_data;
+  chrono::steady_clock::time_point started = chrono::steady_clock::now();
+  bool global = data->rbt->get_lock_mode() == global_lock;
+  if(global) M->begin_read(data->tid);
+  search_thread(data);
+  if(global) M->end_read(data->tid);
+  finish_run(data, 1, started);
+  return NULL;
 }
 
 /**
- * Prints the skeleton of the tree.
+ * Reader function that runs a whole run of searches
+ * as one interleaved, prefetching batch.
+ * RETURNS a void pointer
  */
-void RBTree::print_tree()
+void* batch_reader(void* reader_data)
 {
-  if(root != NULL) {
-    print_tree_helper(this->root, "", true);
+  t_data data;
+  data = (t_data) reader_data;
+  chrono::steady_clock::time_point started = chrono::steady_clock::now();
+  bool global = data->rbt->get_lock_mode() == global_lock;
+  if(global) M->begin_read(data->tid);
+  vector<int_rbtree::node_p> found = data->rbt->search_many(data->batch);
+  if(global) M->end_read(data->tid);
+
+  for(unsigned i = 0; i < found.size(); i++) {
+    data->run[i]->result.found = found[i] != NULL;
   }
+  finish_run(data, found.size(), started);
+  return NULL;
 }
 
 /**
- * Helper function that helps build the initial 
- * tree in prefix order from the given input file
- * in a binary search tree fashion.
- * RETURNS a new node if n happens to be null.
+ * Writer function that alters 
+ * the contents of the tree if there 
+ * are no readers searching through the tree.
+ * RETURNS a void pointer
  */
-node_p RBTree::build_tree_helper(node_p n, tmp_node_p curr)
+void* writer(void* writer_data)
 {
-  if(n == NULL) {
-    n = new node(curr->key);
-    n->color = curr->color;
-  }
-  else if(curr->key > n->key) {
-    n->right = build_tree_helper(n->right, curr);
-    n->right->parent = n;
+  t_data data;
+  data = (t_data) writer_data;
+  chrono::steady_clock::time_point started = chrono::steady_clock::now();
+  if(C != NULL) {
+    if(data->op->operation == op_insert) C->insert_node(data->op->key);
+    else C->delete_node(data->op->key);
+    finish_run(data, 1, started);
+    return NULL;
   }
-  else {
-    n->left = build_tree_helper(n->left, curr);
-    n->left->parent = n;
+  bool global = data->rbt->get_lock_mode() == global_lock;
+  if(global) M->begin_write(data->tid);
+  if(data->op->operation == op_insert) {
+    insert_thread(data);
   }
-  return n;
+  else delete_thread(data);
+  if(global) M->end_write(data->tid);
+  finish_run(data, 1, started);
+  return NULL;
 }
 
 /**
- * Builds the initial red-black tree in 
- * prefix order as a binary search tree since
- * the input file is said to always be a valid red
- * black tree.
+ * Writer function that applies a whole run of inserts
+ * or deletes with a single acquisition of the tree.
+ * RETURNS a void pointer
  */
-void RBTree::build_tree()
+void* batch_writer(void* writer_data)
 {
-  vector<tmp_node_p>::const_iterator itv;
-  itv = tmp_tree.begin();
-  
-  tmp_node_p root_tmp = *itv;
-  root = build_tree_helper(root, root_tmp);
-  itv++;
-  while(itv != tmp_tree.end()) {
-    tmp_node_p curr = *itv;
-    if(curr->key != -1) {
-      last = curr;
-      build_tree_helper(root, curr);
-    }
-    itv++;
+  t_data data;
+  data = (t_data) writer_data;
+  chrono::steady_clock::time_point started = chrono::steady_clock::now();
+  bool global = data->rbt->get_lock_mode() == global_lock;
+  if(global) M->begin_write(data->tid);
+  if(data->op->operation == op_insert) {
+    data->rbt->insert_batch(data->batch);
   }
+  else data->rbt->delete_batch(data->batch);
+  if(global) M->end_write(data->tid);
+  finish_run(data, data->batch.size(), started);
+  return NULL;
 }
 
 /**
- * Class representing all the input/output
- * procedures of the project. This includes 
- * functions for readind the input file and creating
- * the output file, as well as parsing.
- */
-class IO {
-public:
-  vector<tmp_node_p> tree;
-  vector<int> worker_threads;
-  vector<t_op> searchers;
-  vector<t_op> modifiers;
-
-  void parse_tree_line(string line);
-  void parse_thread_lines(string lines);
-  void parse_invocation_lines(string lines);
-  void parse_input_file(string filename);
-  void write_output(string output_filename, results_p results);
-};
-
-/**
- * Parses the first line of the input file
- * containing the tree in prefix order.
+ * Collects the keys of the run of at most max operations in
+ * ops that starts at i and all share its operation. Searches
+ * commute with each other, as do inserts and as do deletes, so
+ * such a run can be applied as one batch without changing which
+ * keys end up in the tree.
+ * RETURNS the index just past the run.
  */
-void IO::parse_tree_line(string line)
+unsigned gather_batch(vector<t_op>& ops, unsigned i, t_data data, unsigned max)
 {
-  stringstream ss(line);
-
-  while(ss.good()) {
-    tmp_node_p n = new tmp_node;
-    string s;
-    getline(ss, s, ',');
-    if(s[s.length() - 1] == '\n') {
-      s = s.substr(0, s.length() - 1);
-    }
-    
-    if(s[0] == 'f') {
-      n->color = black;
-      n->key = -1;
-    }
-    else {
-      if(s[s.length() - 1] == 'b') {
-	n->color = black;
-      }
-      else if(s[s.length() - 1] == 'r') {
-	n->color = red;
-      }
-      s[s.length() - 1] = '\0';
-      n->key = stoi(s);
-    }
-    tree.push_back(n);
+  data->op = ops[i];
+  data->run = &ops[i];
+  data->batch.clear();
+  while(i < ops.size() && data->batch.size() < max &&
+	ops[i]->operation == data->op->operation) {
+    data->batch.push_back(ops[i]->key);
+    i++;
   }
+  return i;
 }
 
 /**
- * Parses the thread lines that contain the 
- * number of search and modify threads.
+ * Hands every invocation to the worker pools, in phases or
+ * mixed, and waits until the last of them has finished. With
+ * freeze the search phase runs against a frozen copy of the tree,
+ * which the first modification then throws away.
  */
-void IO::parse_thread_lines(string lines)
+void run_invocations(IO& io, int_rbtree* rbt, thread_pool& search_pool, thread_pool& modify_pool,
+		     vector<thread_data>& data, results_p r, bool mixed, bool batch, bool freeze)
 {
-  stringstream ss(lines);
-  int search = 0;
-  int modify = 0;
-  vector<int> v;
-  
-  while(ss.good()) {
-    string curr;
-    getline(ss, curr, '\n');
-    if(curr.length() == 0) break;
-    string first = curr.substr(0, curr.find(" "));
-    for(string::size_type i = 0; i < first.length(); i++) {
-      if(isupper(first[i])) {
-	first[i] = first[i] + 32;
+  int tid = 0;
+  if(mixed) {
+    // dispatch everything in invocation order and let the monitor arbitrate
+    for(unsigned i = 0; i < io.invocations.size(); tid++) {
+      data[tid].op = io.invocations[i];
+      data[tid].rbt = rbt;
+      data[tid].results = r;
+      data[tid].tid = tid;
+      data[tid].run = &data[tid].op;
+
+      if(batch) {
+	bool search = data[tid].op->operation == op_search;
+	i = gather_batch(io.invocations, i, &data[tid], io.invocations.size());
+	if(search) search_pool.submit(batch_reader, &data[tid]);
+	else modify_pool.submit(batch_writer, &data[tid]);
+      }
+      else if(data[tid].op->operation == op_search) {
+	search_pool.submit(reader, &data[tid]);
+	i++;
+      }
+      else {
+	modify_pool.submit(writer, &data[tid]);
+	i++;
       }
     }
+    search_pool.wait_idle();
+    modify_pool.wait_idle();
+  }
+
+  if(freeze && !mixed) rbt->freeze();
 
-    int num = 0;
-    if(curr[curr.length() - 3] == ' ') {
-      string s = curr.substr(curr.length() - 2);
-      num = stoi(s);
+  // batched searches are split evenly over the search workers
+  unsigned share = (io.searchers.size() + search_pool.size() - 1) / search_pool.size();
+  for(unsigned i = 0; !mixed && i < io.searchers.size(); tid++) {
+    data[tid].op = io.searchers[i];
+    data[tid].rbt = rbt;
+    data[tid].results = r;
+    data[tid].tid = tid;
+    data[tid].run = &data[tid].op;
+
+    if(batch) {
+      i = gather_batch(io.searchers, i, &data[tid], share);
+      search_pool.submit(batch_reader, &data[tid]);
     }
-    else if(curr[curr.length() - 2] == ' ') {
-      num = curr[curr.length() - 1] - '0';
+    else {
+      search_pool.submit(reader, &data[tid]);
+      i++;
     }
-    
-    if(first == "search") {
-      search = num;
+  }
+  search_pool.wait_idle();
+
+  for(unsigned i = 0; !mixed && i < io.modifiers.size(); tid++) {
+    data[tid].op = io.modifiers[i];
+    data[tid].rbt = rbt;
+    data[tid].results = r;
+    data[tid].tid = tid;
+    data[tid].run = &data[tid].op;
+
+    // modifications are still applied one at a time (or one batch
+    // at a time), in input order
+    if(batch) {
+      i = gather_batch(io.modifiers, i, &data[tid], io.modifiers.size());
+      modify_pool.submit(batch_writer, &data[tid]);
     }
     else {
-      modify = num;
+      modify_pool.submit(writer, &data[tid]);
+      i++;
     }
+    modify_pool.wait_idle();
   }
 
-  v.push_back(search);
-  v.push_back(modify);
-  worker_threads = v;
 }
 
 /**
- * Parses the invocation lines that contain
- * all the search, insert, and delete operations
- * that will be perfomed on the tree.
+ * Hands one invocation to the asynchronous front-end; the
+ * callback fills in its result from whichever worker ran it.
  */
-void IO::parse_invocation_lines(string lines)
+void submit_async(int_async* async, t_op op)
 {
-  vector<t_op> s_op_v;
-  vector<t_op> m_op_v;
-  stringstream ss(lines);
-  string op, line, curr;
-  int key = 0;
-
-  while(ss.good()) {
-    getline(ss, line, '\n');
-    if(line.length() == 0) break;
-    stringstream ss2(line);
-    while(ss2.good()) {
-      t_op invo = new tree_op;
-      getline(ss2, curr, '|');
-      if(curr.length() == 0) break;
-      if(curr[0] == ' ') curr = curr.substr(1);
-      op = curr.substr(0, curr.find("("));
-      invo->operation = op;
-      key = stoi(curr.substr(op.length() + 1, curr.find(")")));
-      invo->key = key;
-      if(invo->operation == "search") s_op_v.push_back(invo);
-      else m_op_v.push_back(invo);
-      getline(ss2, curr, '|');
+  chrono::steady_clock::time_point started = chrono::steady_clock::now();
+  auto done = [op, started](bool ok) {
+    op->result.found = ok;
+    op->result.thread_id = (long) pthread_self();
+    op->result.started = started;
+    op->result.finished = chrono::steady_clock::now();
+    if(op->operation == op_delete && !ok) {
+      cout << "Error: couldn't find " << op->key << "in the tree." << endl;
     }
-  } 
-  
-  searchers = s_op_v;
-  modifiers = m_op_v;
-}
-
-/**
- * Parent parser function that calls upon 
- * the above three to parse the input file.
- */
-void IO::parse_input_file(string filename)
-{
-  string curr, s;
-  int num_blanks = 0;
-  ifstream file(filename);
+  };
 
-  if(file.is_open()) {
-    while(getline(file, curr)) {
-      if(curr == "") {
-	num_blanks++;
-	if(num_blanks == 1) {
-	  parse_tree_line(s);
-	}
-	else if(num_blanks == 2) {
-	  parse_thread_lines(s);
-	}
-	s = "";
-	continue;
-      }
-      else s += curr + "\n";
-    }
-    parse_invocation_lines(s);
-    file.close();
-  }
-  else {
-    cout << "Error: unable to open input file!" << endl;
-    exit(1);
-  }
+  if(op->operation == op_search) async->search(op->key, done);
+  else if(op->operation == op_insert) async->insert(op->key, rb_empty(), done);
+  else async->erase(op->key, done);
 }
 
 /**
- * Creates the output file and writes it to disk.
- * The output includes the overall execution time
- * of all the invocations, the results from all the searches,
- * and the final red black tree in prefix order.
+ * Runs every invocation through the asynchronous front-end
+ * instead of the worker pools: all of them at once when mixed,
+ * otherwise all the searches at once and then the modifications
+ * one after another, in input order.
  */
-void IO::write_output(string output_filename, results_p r)
+void run_async(IO& io, int_rbtree* rbt, int_async* async, bool mixed, bool freeze)
 {
-  ofstream file(output_filename);
-  int count = 0;
-
-  if(file.is_open()) {
-    file << "Execution time: " << endl;
-    file << r->time << " seconds" << endl;
-    file << endl;
-    file << "Search output: " << endl;
-
-    if(searchers.size() > (unsigned)worker_threads[0]) count = worker_threads[0];
-    else count = searchers.size();
-      
-      for(int i = 0; i < count; i++) {
-      string s;
-      if(find(r->search_true.begin(), r->search_true.end(), searchers[i]->key) != r->search_true.end()) {
-	s = "true";
-      }
-      else s = "false";
-      file << searchers[i]->operation << "(" << searchers[i]->key << ")->" << s << ", performed by thread: " << r->search_thread_ids[i];
-      file << endl;
+  if(mixed) {
+    for(unsigned i = 0; i < io.invocations.size(); i++) {
+      submit_async(async, io.invocations[i]);
     }
-    file << endl;
-    file << "Final Red-Black Tree: " << endl;
-    file << r->final_rbt << endl;
-    
-    file.close();
-  }
-  else {
-    cout << "Error: unable to open file!" << endl;
-    exit(1);
+    async->wait_idle();
+    return;
   }
-}
 
-/**
- * Thread function that searches the tree
- * for a node with a given key.
- */
-void* search_thread(void* thread_data)
-{
-  t_data data;
-  data = (t_data) thread_data;
-  if(data->rbt.search_tree(data->op->key) != NULL) {
-    data->results->search_true.push_back(data->op->key);
+  if(freeze) rbt->freeze();
+  for(unsigned i = 0; i < io.searchers.size(); i++) {
+    submit_async(async, io.searchers[i]);
   }
-  data->results->search_thread_ids.push_back((long) pthread_self());
-  return NULL;
-}
-
-/**
- * Thread function that inserts a new node
- * into the tree with a given key.
- */
-void* insert_thread(void* thread_data)
-{
-  t_data data;
-  data = (t_data) thread_data;
-  data->rbt.insert_node(data->op->key);
-  return NULL;
-}
+  async->wait_idle();
 
-/**
- * Thread function that deletes a node
- * from the tree with a given key.
- */
-void* delete_thread(void* thread_data)
-{
-  t_data data;
-  data = (t_data) thread_data;
-  data->rbt.delete_node(data->op->key);
-  return NULL;
+  for(unsigned i = 0; i < io.modifiers.size(); i++) {
+    submit_async(async, io.modifiers[i]);
+    async->wait_idle();
+  }
 }
 
-// global rw_monitor class object
-rw_monitor M;
-
 /**
- * Reader function that is used
- * for concurrent searches to the tree
- * using monitors.
- * RETURNS a void pointer
+ * Lists the CPUs a pool's workers are pinned to: the CPUs of
+ * node, as the kernel numbers it, or with node -1 every CPU
+ * taken one node at a time, starting skip CPUs in so two pools
+ * do not begin on the same one.
+ * RETURNS the list.
  */
-void* reader(void* reader_data)
+vector<int> pool_cpus(int node, unsigned skip)
 {
-  t_data data;
-  data = (t_data) reader_data;
-  M.begin_read(data->tid);
-  search_thread(data);
-  M.end_read(data->tid);
-  return NULL;
+  const numa_topology& topology = numa_topology::get();
+  vector<int> cpus = node < 0 ? topology.spread() : topology.node_cpus(topology.node_index(node));
+  rotate(cpus.begin(), cpus.begin() + skip % cpus.size(), cpus.end());
+  return cpus;
 }
 
 /**
- * Writer function that alters 
- * the contents of the tree if there 
- * are no readers searching through the tree.
- * RETURNS a void pointer
+ * Prints the command-line usage of the program.
  */
-void* writer(void* writer_data)
+void usage(const char* name)
 {
-  t_data data;
-  data = (t_data) writer_data;
-  M.begin_write(data->tid);
-  if(data->op->operation == "insert") {
-    insert_thread(data);
-  }
-  else delete_thread(data);
-  M.end_write(data->tid);
-  return NULL;
+  cout << "Usage: " << name << " [-m|--mixed] [-b|--batch] [-l|--lock=global|coupling|rcu|optimistic]\n"
+       << "       [-r|--rwlock=monitor|futex|distributed] [-p|--policy=readers|writers|fair]\n"
+       << "       [-L|--load=snapshot] [-s|--save=snapshot] [-o|--output=file]\n"
+       << "       [-S|--search-threads=n] [-M|--modify-threads=n] [-n|--repeat=n] [-q|--quiet]\n"
+       << "       [-t|--stats] [-j|--json=file] [-c|--combine] [-f|--freeze] [-a|--async]\n"
+       << "       [-P|--pin] [-N|--numa-node=n] <input file>" << endl;
+  cout << "  -m, --mixed   interleave searches and modifications in invocation order" << endl;
+  cout << "  -b, --batch   run each run of consecutive searches, inserts or deletes" << endl;
+  cout << "                as one batch" << endl;
+  cout << "  -l, --lock    global: one rw_monitor for the whole tree (default)" << endl;
+  cout << "                coupling: hand-over-hand per-node locks; writers lock" << endl;
+  cout << "                only the nodes their change reaches and run side by side" << endl;
+  cout << "                rcu: lock-free searches, epoch-based reclamation" << endl;
+  cout << "                optimistic: lock-free searches that check node versions" << endl;
+  cout << "                and start over if a writer changed their path" << endl;
+  cout << "  -r, --rwlock  lock used in global mode: monitor (default), futex" << endl;
+  cout << "                (one atomic word) or distributed (per-thread reader counters)" << endl;
+  cout << "  -p, --policy  who the monitor favors: readers (default), writers," << endl;
+  cout << "                or fair (first come, first served)" << endl;
+  cout << "  -L, --load    start from a binary snapshot instead of the input's tree" << endl;
+  cout << "  -s, --save    write the final tree to a binary snapshot" << endl;
+  cout << "  -o, --output  write the results here instead of asking for a file name" << endl;
+  cout << "  -S, --search-threads, -M, --modify-threads" << endl;
+  cout << "                size the pools, overriding the input's thread lines" << endl;
+  cout << "  -n, --repeat  run the invocations n times, each time on a fresh copy of" << endl;
+  cout << "                the input's tree; the results of the last run are written" << endl;
+  cout << "  -q, --quiet   print only the time of every run, and write a file only" << endl;
+  cout << "                if -o is given" << endl;
+  cout << "  -t, --stats   add latency percentiles and the shape of the final tree to" << endl;
+  cout << "                the results; a build with make STATS=-DRB_STATS adds" << endl;
+  cout << "                rotation counts and lock wait and hold times" << endl;
+  cout << "  -j, --json    write the same statistics to file as JSON" << endl;
+  cout << "  -c, --combine have one writer at a time apply the pending inserts and" << endl;
+  cout << "                deletes of all the others (flat combining); not with -b" << endl;
+  cout << "  -f, --freeze  run the search phase against a read-only copy of the tree" << endl;
+  cout << "                in Eytzinger order; the first modification drops it" << endl;
+  cout << "  -a, --async   submit the invocations to an asynchronous front-end that" << endl;
+  cout << "                batches them on one pool of both pools' size; -b and" << endl;
+  cout << "                -c do not apply" << endl;
+  cout << "  -P, --pin     pin every worker to a core of its own, taking the cores of" << endl;
+  cout << "                each socket in turn" << endl;
+  cout << "  -N, --numa-node" << endl;
+  cout << "                keep the tree's nodes in node n's memory, n being the" << endl;
+  cout << "                kernel's number of a node with cores; with -P the" << endl;
+  cout << "                workers are pinned to that node's cores only" << endl;
 }
 
 /**
  * Main function that outputs a command-line
  * user interface to the user with cool colors.
  * Performs the parsing and building of the tree
- * and all the thread creation.
+ * and hands every invocation to the worker pools.
  */
 int main(int argc, char* argv[])
 {
   string filename, output_filename;
   IO io;
+  bool mixed = false;
+  bool batch = false;
+  lock_mode mode = global_lock;
+  string lock_kind = "monitor";
+  string load_path, save_path;
+  rw_policy policy = prefer_readers;
+  int search_threads = 0, modify_threads = 0;
+  int repeat = 1;
+  bool quiet = false;
+  bool stats = false;
+  string json_path;
+  bool combine = false;
+  bool freeze = false;
+  bool use_async = false;
+  bool pin = false;
+  int numa_node = -1;
+
+  static struct option long_options[] = {
+    { "mixed", no_argument, NULL, 'm' },
+    { "batch", no_argument, NULL, 'b' },
+    { "lock", required_argument, NULL, 'l' },
+    { "rwlock", required_argument, NULL, 'r' },
+    { "policy", required_argument, NULL, 'p' },
+    { "load", required_argument, NULL, 'L' },
+    { "save", required_argument, NULL, 's' },
+    { "output", required_argument, NULL, 'o' },
+    { "search-threads", required_argument, NULL, 'S' },
+    { "modify-threads", required_argument, NULL, 'M' },
+    { "repeat", required_argument, NULL, 'n' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "stats", no_argument, NULL, 't' },
+    { "json", required_argument, NULL, 'j' },
+    { "combine", no_argument, NULL, 'c' },
+    { "freeze", no_argument, NULL, 'f' },
+    { "async", no_argument, NULL, 'a' },
+    { "pin", no_argument, NULL, 'P' },
+    { "numa-node", required_argument, NULL, 'N' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while((opt = getopt_long(argc, argv, "mbl:r:p:L:s:o:S:M:n:qtj:cfaPN:", long_options, NULL)) != -1) {
+    switch(opt) {
+    case 'm':
+      mixed = true;
+      break;
+    case 'b':
+      batch = true;
+      break;
+    case 'l':
+      if(string(optarg) == "global") mode = global_lock;
+      else if(string(optarg) == "coupling") mode = lock_coupling;
+      else if(string(optarg) == "rcu") mode = rcu;
+      else if(string(optarg) == "optimistic") mode = optimistic;
+      else {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      if(!int_rbtree::supports(mode)) {
+	cout << FRED("ERROR") ": " << optarg << " mode needs node locks, which this node layout leaves out!" << endl;
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      lock_kind = optarg;
+      break;
+    case 'p':
+      if(string(optarg) == "readers") policy = prefer_readers;
+      else if(string(optarg) == "writers") policy = prefer_writers;
+      else if(string(optarg) == "fair") policy = fair;
+      else {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'L':
+      load_path = optarg;
+      break;
+    case 's':
+      save_path = optarg;
+      break;
+    case 'o':
+      output_filename = optarg;
+      break;
+    case 'S':
+      search_threads = atoi(optarg);
+      break;
+    case 'M':
+      modify_threads = atoi(optarg);
+      break;
+    case 'n':
+      repeat = atoi(optarg);
+      break;
+    case 'q':
+      quiet = true;
+      break;
+    case 't':
+      stats = true;
+      break;
+    case 'j':
+      json_path = optarg;
+      break;
+    case 'c':
+      combine = true;
+      break;
+    case 'f':
+      freeze = true;
+      break;
+    case 'a':
+      use_async = true;
+      break;
+    case 'P':
+      pin = true;
+      break;
+    case 'N':
+      numa_node = atoi(optarg);
+      if(numa_node < 0 || numa_topology::get().node_index(numa_node) < 0) {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  cout << "----------------------------------------" << endl;
-  cout << FYEL("PROJECT") ": CONCURRENT RED - BLACK TREES\n" FGRN("CLASS")
-    ": COM S 352\n" FBLU("AUTHOR") ": LORENZO ZENITSKY" << endl;
-  cout << "----------------------------------------\n" << endl;
+  if(!quiet) {
+    cout << "----------------------------------------" << endl;
+    cout << FYEL("PROJECT") ": CONCURRENT RED - BLACK TREES\n" FGRN("CLASS")
+      ": COM S 352\n" FBLU("AUTHOR") ": LORENZO ZENITSKY" << endl;
+    cout << "----------------------------------------\n" << endl;
+  }
 
-  if(!argv[1]) {
+  M = make_rw_lock(lock_kind, policy);
+  // a batch already takes the write lock once, so there is nothing left to combine
+  if(M == NULL || search_threads < 0 || modify_threads < 0 || repeat < 1 || (batch && combine)) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if(optind >= argc) {
     cout << FRED("ERROR") ": Please specify an input file for the program to read!" << endl;
+    usage(argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
-  filename = argv[1];
-  io.parse_input_file(filename);
+  filename = argv[optind];
 
-  RBTree rbt(io.tree);
-  rbt.build_tree();
+  // repeated runs rebuild the tree each time, so then it is kept as parsed
+  int_rbtree* rbt = new int_rbtree;
+  rbt->set_numa_node(numa_node);
+  io.parse_input_file(filename, load_path.empty() && repeat == 1 ? rbt : NULL);
+  if(search_threads > 0) io.worker_threads[0] = search_threads;
+  if(modify_threads > 0) io.worker_threads[1] = modify_threads;
 
-  queue<t_op> search;
-  queue<t_op> modify;
   results_p r = new results;
+  r->stats = stats;
 
-  int NUM_THREADS = io.worker_threads[0] + io.worker_threads[1];
-  pthread_t threads[NUM_THREADS];
-
-  for(unsigned i = 0; i < io.searchers.size(); i++) {
-    search.push(io.searchers[i]);
+  // the pools are sized from the thread lines and stay up for the whole run
+  vector<int> search_cpus, modify_cpus;
+  if(pin) {
+    search_cpus = pool_cpus(numa_node, 0);
+    modify_cpus = pool_cpus(numa_node, io.worker_threads[0]);
   }
-  for(unsigned i = 0; i < io.modifiers.size(); i++) {
-    modify.push(io.modifiers[i]);
-  }
-
-  int s_thread_count = 0;
-  while(!search.empty() && s_thread_count < io.worker_threads[0]) {
-    t_op tmp = search.front();
-    t_data data = new thread_data;
-    data->op = tmp;
-    data->rbt = rbt;
-    data->results = r;
-    data->tid = s_thread_count;
-
-    if(pthread_create(&threads[s_thread_count], NULL, reader, data)) {
-      cout << "Error: unable to create search thread " << s_thread_count << endl;
+  thread_pool search_pool(io.worker_threads[0], search_cpus);
+  thread_pool modify_pool(io.worker_threads[1], modify_cpus);
+  vector<thread_data> data(io.searchers.size() + io.modifiers.size());
+
+  for(int run = 0; run < repeat; run++) {
+    if(run > 0) {
+      delete rbt;
+      rbt = new int_rbtree;
+      rbt->set_numa_node(numa_node);
     }
-
-    s_thread_count++;
-    search.pop();
-  }
-  
-  for (int i = 0; i < s_thread_count; i++) { 
-    pthread_join(threads[i], NULL); 
-  }
-
-  int m_thread_count = s_thread_count;
-  while(!modify.empty() && ((m_thread_count - s_thread_count) < io.worker_threads[1])) {
-    t_op tmp = modify.front();
-    t_data data = new thread_data;
-    data->op = tmp;
-    data->rbt = rbt;
-    data->results = r;
-    data->tid = m_thread_count;
-
-    if(tmp->operation == "insert") {
-      if(pthread_create(&threads[m_thread_count], NULL, writer, data)) {
-	cout << "Error: unable to create insert thread " << m_thread_count << endl;
+    if(!load_path.empty()) {
+      if(!rbt->load_snapshot(load_path)) {
+	cout << FRED("ERROR") ": " << load_path << " is not a tree snapshot!" << endl;
+	exit(EXIT_FAILURE);
       }
     }
-    else {
-      if(pthread_create(&threads[m_thread_count], NULL, writer, data)) {
-	cout << "Error: unable to create delete thread " << m_thread_count << endl;
+    else if(repeat > 1) {
+      if(!rbt->build_tree(io.tree)) {
+	cout << "Error: malformed tree in the input file!" << endl;
+	exit(EXIT_FAILURE);
       }
     }
+    rbt->set_lock_mode(mode);
+    if(combine) {
+      delete C;
+      C = new int_combiner(rbt, mode == global_lock ? M : NULL);
+    }
+    int_async* async = NULL;
+    if(use_async) {
+      async = new int_async(rbt, mode == global_lock ? M : NULL,
+			    io.worker_threads[0] + io.worker_threads[1], search_cpus);
+    }
+    rb_stats::reset();
+
+    // only the operations themselves are timed
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    if(async != NULL) run_async(io, rbt, async, mixed, freeze);
+    else run_invocations(io, rbt, search_pool, modify_pool, data, r, mixed, batch, freeze);
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+    delete async;
+
+    std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
+    r->time = time_span.count();
+    if(quiet) cout << r->time << endl;
+    else if(repeat > 1) cout << "Run " << run + 1 << ": " << r->time << " seconds" << endl;
+  }
 
-    pthread_join(threads[m_thread_count], NULL);
-    m_thread_count++;
-    modify.pop();
+  rbt->prefix_order();
+  r->final_rbt = rbt->get_prefix_tree();
+  if(stats || !json_path.empty()) {
+    io.collect_stats(rbt, r);
+    if(!json_path.empty()) io.write_stats_json(json_path, r);
+  }
+
+  if(!save_path.empty() && !rbt->save_snapshot(save_path)) {
+    cout << FRED("ERROR") ": unable to write the snapshot " << save_path << endl;
+  }
+
+  if(quiet) {
+    if(!output_filename.empty()) io.write_output(output_filename, r);
+    return 0;
   }
 
-  rbt.prefix_order();
-  r->final_rbt = rbt.get_prefix_tree();
-  std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
-  
   cout << FCYN("Filename") ": " << filename << endl << endl;
-  cout << "Please enter a name for the output file: ";
-  cin >> output_filename;
-  cout << endl;
-  
-  std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
-  r->time = time_span.count();
+  if(output_filename.empty()) {
+    cout << "Please enter a name for the output file: ";
+    cin >> output_filename;
+    cout << endl;
+  }
   io.write_output(output_filename, r);
   
   cout << "The following has just been written to the output file, "<< output_filename << "." << endl << endl;
@@ -0,0 +1,2585 @@
+#ifndef _RBTREE_H
+ # define _RBTREE_H
+
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <string>
+#include <functional>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <charconv>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rw_lock.h"
+#include "node_arena.h"
+#include "rb_stats.h"
+#include "frozen_index.h"
+
+// enum representing a node's color - red or black (0 or 1)
+enum Color { red, black };
+
+// enum representing how concurrent operations on the tree are synchronized;
+// in lock_coupling mode writers run side by side as well, each one locking
+// just the nodes its change reaches, while rcu and optimistic run one
+// writer at a time next to any number of readers
+enum lock_mode { global_lock, lock_coupling, rcu, optimistic };
+
+// -DNODE_ALIGN=n aligns every node to n bytes, e.g. 64 for one node per cache line
+#ifdef NODE_ALIGN
+ # define NODE_ALIGNMENT alignas(NODE_ALIGN)
+#else
+ # define NODE_ALIGNMENT
+#endif
+
+// mapped type of a tree that is only used as a set of keys
+struct rb_empty {};
+
+// first bytes of every binary snapshot
+#define SNAPSHOT_MAGIC "RBTSNAP1"
+
+/**
+ * Header of a binary snapshot of a tree. It is followed by
+ * the keys in prefix order, then by the values in the same
+ * order if the tree maps keys to anything, and last by one color
+ * bit per node, set for black. Everything is stored in the byte
+ * order of the machine that wrote it.
+ */
+struct rb_snapshot_header {
+  char magic[8];
+  uint32_t key_size;
+  uint32_t value_size;
+  uint64_t count;
+};
+
+/**
+ * After reading the input file,
+ * temporary nodes are created with just a 
+ * key and color before being used to create the
+ * initial tree.
+ */
+template <class Key>
+struct rb_tmp_node {
+  Key key;
+  bool color;
+};
+
+/**
+ * Represents a standard node in a 
+ * red-black tree. The links and the color are only
+ * reached through the accessors below, so the layout
+ * can be chosen at build time. With -DCOMPACT_NODES each
+ * link is a 32-bit offset, counted in nodes, from the node
+ * itself, and the color is packed into the low bit of the
+ * parent link. That halves the node, but every node of a tree
+ * has to come from the same arena, and a compact node has no
+ * lock of its own either, so the modes that lock or version
+ * single nodes are not available with it; the modes left,
+ * global and RCU and a frozen tree, never touch node locks
+ * anyway. With -DORDER_STATISTICS
+ * every node also counts the nodes of its subtree, which is
+ * what select and rank descend by. Each node carries
+ * its key and the value mapped to it.
+ */
+template <class Key, class Value>
+struct NODE_ALIGNMENT rb_node {
+  typedef rb_node node;
+
+  Key key;
+#ifdef COMPACT_NODES
+  int32_t parent_color;
+  int32_t left_off;
+  int32_t right_off;
+
+  node* parent() const { return at(parent_color >> 1); }
+  node* left() const { return at(left_off); }
+  node* right() const { return at(right_off); }
+  bool color() const { return parent_color & 1; }
+
+  void set_parent(node* n) { parent_color = (int32_t) ((uint32_t) offset(n) << 1) | (parent_color & 1); }
+  void set_left(node* n) { left_off = offset(n); }
+  void set_right(node* n) { right_off = offset(n); }
+  void set_color(bool c) { parent_color = (parent_color & ~1) | c; }
+
+  // used by readers that don't hold a lock and by the writers they race with
+  node* left_acquire() const { return at(__atomic_load_n(&left_off, __ATOMIC_ACQUIRE)); }
+  node* right_acquire() const { return at(__atomic_load_n(&right_off, __ATOMIC_ACQUIRE)); }
+  void publish_left(node* n) { __atomic_store_n(&left_off, offset(n), __ATOMIC_RELEASE); }
+  void publish_right(node* n) { __atomic_store_n(&right_off, offset(n), __ATOMIC_RELEASE); }
+
+  node* at(int32_t off) const { return off == 0 ? NULL : const_cast<node*>(this) + off; }
+  int32_t offset(const node* n) const { return n == NULL ? 0 : (int32_t) (n - this); }
+#else
+  rw_spinlock lock;
+  node* parent_ptr;
+  node* left_ptr;
+  node* right_ptr;
+  bool color_bit;
+
+  node* parent() const { return parent_ptr; }
+  node* left() const { return left_ptr; }
+  node* right() const { return right_ptr; }
+  bool color() const { return color_bit; }
+
+  void set_parent(node* n) { parent_ptr = n; }
+  void set_left(node* n) { left_ptr = n; }
+  void set_right(node* n) { right_ptr = n; }
+  void set_color(bool c) { color_bit = c; }
+
+  // used by readers that don't hold a lock and by the writers they race with
+  node* left_acquire() const { return __atomic_load_n(&left_ptr, __ATOMIC_ACQUIRE); }
+  node* right_acquire() const { return __atomic_load_n(&right_ptr, __ATOMIC_ACQUIRE); }
+  void publish_left(node* n) { __atomic_store_n(&left_ptr, n, __ATOMIC_RELEASE); }
+  void publish_right(node* n) { __atomic_store_n(&right_ptr, n, __ATOMIC_RELEASE); }
+#endif
+
+#ifdef ORDER_STATISTICS
+  // nodes in the subtree rooted here, this one included; the
+  // arena's capacity keeps it well within 32 bits
+  uint32_t subtree;
+#endif
+
+  // an empty payload takes no room, so a set costs no more than before
+  [[no_unique_address]] Value value;
+
+  rb_node(const Key& key, const Value& value) : key(key), value(value)
+  { 
+#ifdef COMPACT_NODES
+    parent_color = 0;
+#endif
+    set_parent(NULL);
+    set_left(NULL);
+    set_right(NULL);
+    set_color(red); 
+#ifdef ORDER_STATISTICS
+    subtree = 1;
+#endif
+  } 
+};
+
+#ifdef COMPACT_NODES
+// the parent link gives up one bit to the color
+static_assert(node_arena<rb_node<int, rb_empty> >::DEFAULT_CAPACITY <= ((size_t) 1 << 30),
+	      "compact links cannot reach every node of the arena");
+#if !defined(NODE_ALIGN) && !defined(ORDER_STATISTICS)
+static_assert(sizeof(rb_node<int, rb_empty>) == 16, "a compact int node should take 16 bytes");
+#endif
+#endif
+
+/**
+ * Epoch-based reclamation for RCU-style readers. A reader
+ * only ever stores to its own cache-line sized slot, so lookups
+ * leave every shared cache line untouched. A writer that has
+ * unlinked nodes calls synchronize() to wait until every reader
+ * that might still be looking at them has finished.
+ */
+class epoch_domain {
+private:
+  struct alignas(64) slot {
+    std::atomic<unsigned long> epoch;
+  };
+
+  std::atomic<unsigned long> global_epoch;
+  slot slots[MAX_READERS];
+
+public:
+  epoch_domain()
+  {
+    global_epoch.store(1);
+    for(int i = 0; i < MAX_READERS; i++) {
+      slots[i].epoch.store(0);
+    }
+  }
+
+  /**
+   * Marks the calling thread as reading; 0 means quiescent.
+   */
+  void read_lock()
+  {
+    slot& s = slots[reader_id::self()];
+    s.epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void read_unlock()
+  {
+    slots[reader_id::self()].epoch.store(0, std::memory_order_release);
+  }
+
+  /**
+   * Starts a new epoch and waits for every reader
+   * that entered before it to leave.
+   */
+  void synchronize()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unsigned long target = global_epoch.fetch_add(1) + 1;
+    int readers = reader_id::high_water.load();
+
+    for(int i = 0; i < readers; i++) {
+      unsigned long e;
+      while((e = slots[i].epoch.load(std::memory_order_acquire)) != 0 && e < target) {
+	sched_yield();
+      }
+    }
+  }
+};
+/**
+ * This class represents a red black tree that maps keys
+ * to values; with the default rb_empty value it is a set of
+ * keys. Keys are ordered by Compare, and nodes come from an
+ * Alloc<node>, which has to behave like node_arena.
+ * It includes functions for inserting, deleting,
+ * searching, and printing the tree in different ways.
+ */
+template <class Key, class Value = rb_empty, class Compare = std::less<Key>,
+	  template <class> class Alloc = node_arena>
+class RBTree {
+public:
+  typedef Key key_type;
+  typedef Value value_type;
+  typedef rb_node<Key, Value> node;
+  typedef node* node_p;
+
+  /**
+   * Walks the nodes in key order by following the parent
+   * links, so it needs neither recursion nor a stack. It is
+   * only valid while no writer can run: under the global lock,
+   * or with the tree otherwise quiet.
+   */
+  class iterator {
+  public:
+    iterator(node_p n = NULL) : n(n) {}
+
+    node& operator*() const { return *n; }
+    node_p operator->() const { return n; }
+    bool operator==(const iterator& other) const { return n == other.n; }
+    bool operator!=(const iterator& other) const { return n != other.n; }
+
+    iterator& operator++()
+    {
+      if(n->right() != NULL) {
+	n = n->right();
+	while(n->left() != NULL) n = n->left();
+	return *this;
+      }
+      node_p p = n->parent();
+      while(p != NULL && n == p->right()) {
+	n = p;
+	p = p->parent();
+      }
+      n = p;
+      return *this;
+    }
+  private:
+    node_p n;
+  };
+
+  RBTree();
+  ~RBTree();
+
+  bool build_tree(const std::vector<rb_tmp_node<Key> >& prefix);
+  bool build_push(const Key& key, bool color, const Value& value = Value());
+  void build_finish();
+  bool save_snapshot(const std::string& path);
+  bool load_snapshot(const std::string& path);
+  void build_sorted(const std::vector<Key>& keys);
+  void build_sorted(const std::vector<std::pair<Key, Value> >& entries);
+  void insert_node(const Key& key, const Value& value = Value());
+  void delete_node(const Key& key);
+  bool erase(const Key& key);
+  void insert_batch(std::vector<Key> keys);
+  void insert_batch(std::vector<std::pair<Key, Value> > entries);
+  void delete_batch(std::vector<Key> keys);
+  node_p search_tree(const Key& key);
+  bool lookup(const Key& key, Value& value);
+  std::vector<node_p> search_many(const std::vector<Key>& keys);
+  void freeze();
+  bool is_frozen() { return __atomic_load_n(&frozen, __ATOMIC_ACQUIRE) != NULL; }
+  iterator begin() { return iterator(root == NULL ? NULL : min(root)); }
+  iterator end() { return iterator(); }
+  iterator lower_bound(const Key& key) { return iterator(bound(key, false)); }
+  iterator upper_bound(const Key& key) { return iterator(bound(key, true)); }
+  template <class F> size_t range_scan(const Key& lo, const Key& hi, F callback);
+  size_t count_range(const Key& lo, const Key& hi);
+#ifdef ORDER_STATISTICS
+  node_p select(size_t k);
+  size_t rank(const Key& key);
+  size_t size();
+#endif
+  node_p get_root() { return root; }
+  lock_mode get_lock_mode() { return mode; }
+  static bool supports(lock_mode m);
+  bool set_lock_mode(lock_mode m);
+  void set_numa_node(int node);
+  int get_numa_node() { return numa_node; }
+  void in_order();
+  void level_order();
+  void prefix_order();
+  void print_tree();
+  const std::string& get_prefix_tree();
+private:
+  node_p root;
+  std::vector<node_p> build_path;
+  Key build_low;
+  bool has_low;
+  Key last_key;
+  bool has_last;
+  std::string prefix_tree;
+  lock_mode mode;
+  Compare compare;
+
+  // every node of the tree comes from here, placed on numa_node unless it is -1
+  Alloc<node>* arena;
+  int numa_node;
+
+  // lock-coupling state: guards the root pointer. The gate is held
+  // shared by lock-coupling writers, which only wait on each other's
+  // nodes, and exclusively by writers in the other modes but the global
+  // one and by anything that needs the tree to itself
+  rw_spinlock root_lock;
+  pthread_rwlock_t writer_lock;
+
+  // lock-coupling writers allocate and free nodes side by side
+  pthread_mutex_t arena_lock;
+
+  // RCU mode: unlinked nodes wait here for a grace period
+  epoch_domain* epochs;
+  std::vector<node_p> retired;
+
+  // read-only copy of the keys made by freeze(), NULL once a write
+  // has made it stale; readers reach it under an epoch
+  frozen_index<Key, node_p, Compare>* frozen;
+
+  // workers share one tree through a pointer; a copy would have
+  // its own root and locks but the same nodes
+  RBTree(const RBTree&);
+  RBTree& operator=(const RBTree&);
+
+  // flat combining applies a whole sweep under one begin_modify
+  template <class Tree> friend class write_combiner;
+
+  node_p insert_helper(node_p from, const Key& key, const Value& value);
+  void apply_insert(const Key& key, const Value& value);
+  bool apply_erase(const Key& key, bool complain);
+  node_p climb(node_p from, const Key& key);
+  node_p build_sorted_helper(const std::vector<std::pair<Key, Value> >& entries,
+			     long lo, long hi, int depth, int red_depth);
+  void fix_insert(node_p& root, node_p& node);
+  void fix_double_black(node_p node);
+  void rotate_right(node_p& root, node_p& node);
+  void rotate_left(node_p& root, node_p& node);
+  void in_order_helper(node_p root);
+  void prefix_order_helper(node_p root);
+  void level_order_helper(node_p root);
+  void delete_helper(node_p node);
+  void destroy_helper(node_p node);
+  void print_tree_helper(node_p root, std::string delimiter, bool last);
+  node_p search_helper(node_p node, const Key& key);
+  node_p search_coupled(const Key& key, Value* value);
+  node_p search_rcu(const Key& key, Value* value);
+  node_p search_optimistic(const Key& key, Value* value);
+  bool search_frozen(const Key* keys, size_t count, node_p* found, Value* value);
+  void thaw();
+  node_p bound(const Key& key, bool strict);
+  size_t subtree_size(node_p n);
+  void recount(node_p n);
+  void count_up(node_p from, int delta);
+  void rotate_right_rcu(node_p& root, node_p& node);
+  void rotate_left_rcu(node_p& root, node_p& node);
+  node_p new_node(const Key& key, const Value& value);
+  void destroy_node(node_p n);
+  void build_discard();
+  node_p copy_node(node_p n, node_p from);
+  void link_root(node_p child);
+  void link_left(node_p parent, node_p child);
+  void link_right(node_p parent, node_p child);
+  void replace_child(node_p parent, node_p old, node_p child);
+  void free_node(node_p n);
+  void reclaim(std::vector<node_p>& batch);
+  bool unlocked_readers() { return mode == rcu || mode == optimistic; }
+  rw_spinlock& lock_of(node_p node);
+  void write_lock(node_p node);
+  void write_unlock(node_p node);
+  static std::vector<rw_spinlock*>& held();
+  void hold(rw_spinlock& lock);
+  void hold(node_p node);
+  void release_above(node_p node);
+  void release(node_p node);
+  void release_held();
+  node_p find_victim(const Key& key, bool& empty);
+  void begin_modify(bool exclusive = false);
+  void end_modify();
+  node_p min(node_p node);
+  node_p replace(node_p node);
+  bool is_on_left(node_p node);
+  node_p sibling(node_p node);
+  bool red_child(node_p node);
+  void swap_keys(node_p u, node_p v);
+};
+
+// out-of-class definitions of the tree's members
+#define RB_TEMPLATE template <class Key, class Value, class Compare, template <class> class Alloc>
+#define RB_TREE RBTree<Key, Value, Compare, Alloc>
+
+// how many unlinked nodes RCU mode lets pile up before waiting for readers
+#define RETIRE_BATCH 128
+
+// how many lookups search_many keeps in flight at once
+#define SEARCH_GROUP 8
+
+/**
+ * Creates an empty tree in global lock mode.
+ */
+RB_TEMPLATE
+RB_TREE::RBTree()
+{
+  root = NULL;
+  has_last = false;
+  has_low = false;
+  mode = global_lock;
+  arena = NULL;
+  numa_node = -1;
+  frozen = NULL;
+  epochs = new epoch_domain();
+
+  // a freeze or a combiner sweep waiting for the gate keeps new writers out
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&writer_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&arena_lock, NULL);
+}
+
+/**
+ * Destructs whatever is still in the tree and releases
+ * the arena. No thread may be using the tree anymore.
+ */
+RB_TEMPLATE
+RB_TREE::~RBTree()
+{
+  if(arena != NULL) {
+    if constexpr(!std::is_trivially_destructible<node>::value) {
+      destroy_helper(root);
+      for(unsigned i = 0; i < retired.size(); i++) {
+	retired[i]->~node();
+      }
+    }
+    delete arena;
+  }
+  pthread_rwlock_destroy(&writer_lock);
+  pthread_mutex_destroy(&arena_lock);
+  delete epochs;
+  delete frozen;
+}
+
+/**
+ * Helper function that runs the destructor of every
+ * node below and including node.
+ */
+RB_TEMPLATE
+void RB_TREE::destroy_helper(node_p node)
+{
+  if(node == NULL) return;
+  destroy_helper(node->left());
+  destroy_helper(node->right());
+  node->~node();
+}
+
+/**
+ * Helper function that prints out the tree
+ * in a skeleton-like manner showing the connections
+ * between all nodes.
+ */
+RB_TEMPLATE
+void RB_TREE::print_tree_helper(node_p root, std::string delimiter, bool last)
+{
+  if(root != NULL) {
+    std::cout << delimiter;
+
+    if(last) {
+      std::cout << "R----";
+      delimiter += "    ";
+    }
+    else {
+      std::cout << "L----";
+      delimiter += "|   ";
+    }
+
+    std::string c = root->color() ? "BLACK" : "RED";
+    std::cout << root->key << "(" << c << ")" << std::endl;
+    print_tree_helper(root->left(), delimiter, false);
+    print_tree_helper(root->right(), delimiter, true);
+  }
+}
+
+/**
+ * Helper function for printing out the 
+ * tree in an in-order fashion.
+ */
+RB_TEMPLATE
+void RB_TREE::in_order_helper(node_p root)
+{
+  if(root == NULL) return;
+
+  in_order_helper(root->left());
+  std::cout << root->key << " ";
+  in_order_helper(root->right());
+}
+
+/**
+ * Helper function for printing out 
+ * the tree in a level-order fashion.
+ */
+RB_TEMPLATE
+void RB_TREE::level_order_helper(node_p root)
+{
+  if(root == NULL) return;
+  
+  std::queue<node_p> q;
+  q.push(root);
+
+  while(!q.empty()) {
+    node_p temp = q.front();
+    std::cout << temp->key << " ";
+    q.pop();
+
+    if(temp->left() != NULL) {
+      q.push(temp->left());
+    }
+    if(temp->right() != NULL) {
+      q.push(temp->right());
+    }
+  }
+}
+
+/**
+ * Used to get the final red-black tree string.
+ * RETURNS the final red-black tree in prefix order 
+ * as a string 
+ */
+RB_TEMPLATE
+const std::string& RB_TREE::get_prefix_tree()
+{
+  return prefix_tree;
+}
+
+/**
+ * Helper function for building the final red
+ * black tree in prefix order as a string.
+ */
+RB_TEMPLATE
+void RB_TREE::prefix_order_helper(node_p node)
+{
+  if(node == NULL) return;
+
+  // each node is formatted in place and appended in one go
+  char buf[64];
+  char* p = std::to_chars(buf, buf + sizeof(buf) - 6, node->key).ptr;
+  *p++ = node->color() ? 'b' : 'r';
+  *p++ = ',';
+  if(node->left() == NULL) {
+    *p++ = 'f';
+    *p++ = ',';
+  }
+  if(node->right() == NULL && !(has_last && !compare(last_key, node->key) && !compare(node->key, last_key))) {
+    *p++ = 'f';
+    *p++ = ',';
+  }
+  prefix_tree.append(buf, p);
+
+  prefix_order_helper(node->left());
+  prefix_order_helper(node->right());
+}
+
+/**
+ * Prints out the tree in-order.
+ */
+RB_TEMPLATE
+void RB_TREE::in_order()
+{
+  in_order_helper(root);
+}
+
+/**
+ * Prints out the tree in level-order.
+ */
+RB_TEMPLATE
+void RB_TREE::level_order()
+{
+  level_order_helper(root);
+}
+
+/**
+ * Builds the final red-black tree as a string
+ * in prefix order.
+ */
+RB_TEMPLATE
+void RB_TREE::prefix_order() {
+  // clearing keeps the buffer from the last call
+  prefix_tree.clear();
+  prefix_order_helper(root);
+}
+
+/**
+ * Helper function used to insert a node into the tree.
+ * A single descent, from the root or from a node whose subtree
+ * is known to cover the key, finds the attach point and, on the
+ * way, any node that already holds the key; a node is only
+ * allocated once the key is known to be new.
+ * RETURNS the new node, NULL if the key was already there.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::insert_helper(node_p from, const Key& key, const Value& value)
+{
+  node_p parent = NULL;
+  bool left = false;
+
+  // lock-coupling writers lock their way down; the fix-up cannot rise
+  // above the upper one of two black nodes in a row, so every lock above
+  // that one can go
+  hold(root_lock);
+  node_p curr = from == NULL ? root : from;
+
+  while(curr != NULL) {
+    hold(curr);
+    if(parent != NULL && parent->color() == black && curr->color() == black) {
+      release_above(parent);
+    }
+    parent = curr;
+    if(compare(key, curr->key)) {
+      curr = curr->left();
+      left = true;
+    }
+    else if(compare(curr->key, key)) {
+      curr = curr->right();
+      left = false;
+    }
+    else return NULL;
+  }
+
+  node_p node = new_node(key, value);
+  node->set_parent(parent);
+  write_lock(parent);
+  if(parent == NULL) link_root(node);
+  else if(left) link_left(parent, node);
+  else link_right(parent, node);
+  write_unlock(parent);
+  count_up(parent, 1);
+
+  return node;
+}
+
+/**
+ * Fixes any inconsistencies caused by deleting a node
+ * from the tree.
+ */
+RB_TEMPLATE
+void RB_TREE::fix_double_black(node_p node)
+{
+  if(node->parent() == NULL) return;
+
+  node_p sib = sibling(node), parent = node->parent();
+  hold(sib);
+  if(sib != NULL) {
+    hold(sib->left());
+    hold(sib->right());
+  }
+  if(sib == NULL) {
+    fix_double_black(parent);
+  }
+  else {
+    if(sib->color() == red) {
+      parent->set_color(red);
+      sib->set_color(black);
+      if(is_on_left(sib)) {
+	rotate_right(root, parent);
+      }
+      else {
+	rotate_left(root, parent);
+      }
+      fix_double_black(node);
+    }
+    else {
+      if(red_child(sib)) {
+	if(sib->left() != NULL && sib->left()->color() == red) {
+	  if(is_on_left(sib)) {
+	    sib->left()->set_color(sib->color());
+	    sib->set_color(parent->color());
+	    rotate_right(root, parent);
+	  }
+	  else {
+	    sib->left()->set_color(parent->color());
+	    rotate_right(root, sib);
+	    rotate_left(root, parent);
+	  }
+	}
+	else {
+	  if(is_on_left(sib)) {
+	    sib->right()->set_color(parent->color());
+	    rotate_left(root, sib);
+	    rotate_right(root, parent);
+	  }
+	  else {
+	    sib->right()->set_color(sib->color());
+	    sib->set_color(parent->color());
+	    rotate_left(root, parent);
+	  }
+	}
+	parent->set_color(black);
+      }
+      else {
+	sib->set_color(red);
+	RB_COUNT(recolors);
+	if(parent->color() == black) {
+	  fix_double_black(parent);
+	}
+	else {
+	  parent->set_color(black);
+	}
+      }
+    }
+  }
+}
+
+/**
+ * RETURNS true if node has a red child, false otherwise.
+ */
+RB_TEMPLATE
+bool RB_TREE::red_child(node_p node)
+{
+  return (node->left() != NULL && node->left()->color() == red) ||
+    (node->right() != NULL && node->right()->color() == red);
+}
+
+/**
+ * RETURNS true if node is on the 
+ * left side of its parent, false otherwise.
+ */
+RB_TEMPLATE
+bool RB_TREE::is_on_left(node_p node)
+{
+  return node == node->parent()->left();
+}
+
+/**
+ * RETURNS the node's sibling if 
+ * it has one, NULL node otherwise.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::sibling(node_p node)
+{
+  if(node->parent() == NULL) {
+    return NULL;
+  }
+  if(is_on_left(node)) {
+    return node->parent()->right();
+  }
+  return node->parent()->left();
+}
+
+/**
+ * RETURNS the min node of the tree.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::min(node_p node)
+{
+  node_p tmp = node;
+  while(tmp->left() != NULL) {
+    tmp = tmp->left();
+  }
+
+  return tmp;
+}
+
+/**
+ * Function for swapping the keys, and the
+ * values that go with them, of two nodes.
+ */
+RB_TEMPLATE
+void RB_TREE::swap_keys(node_p u, node_p v)
+{
+  std::swap(u->key, v->key);
+  std::swap(u->value, v->value);
+}
+
+/**
+ * This function finds the node that is
+ * to replace the deleted node in the tree.
+ * RETURNS the node that will replace the node 
+ * to be deleted in the tree
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::replace(node_p node)
+{
+  if(node->left() != NULL && node->right() != NULL) {
+    return min(node->right());
+  }
+  if(node->left() == NULL && node->right() == NULL) {
+    return NULL;
+  }
+  if(node->left() != NULL) {
+    return node->left();
+  }
+  else {
+    return node->right();
+  }
+}
+
+/**
+ * Deletes a node from the tree 
+ * with the given key.
+ */
+RB_TEMPLATE
+void RB_TREE::delete_helper(node_p n)
+{
+  node_p m = replace(n);
+  hold(m);
+
+  bool bb = ((m == NULL || m->color() == black) && (n->color() == black));
+  node_p parent = n->parent();
+
+  if(m == NULL) {
+    if(parent == NULL) {
+      write_lock(NULL);
+      write_lock(n);
+      replace_child(NULL, n, NULL);
+      write_unlock(n);
+      write_unlock(NULL);
+    }
+    else {
+      if(bb) {
+	fix_double_black(n);
+      }
+      else {
+	if(sibling(n) != NULL) {
+	  hold(sibling(n));
+	  sibling(n)->set_color(red);
+	}
+      }
+
+      // an RCU rotation may have replaced the parent with a copy
+      parent = n->parent();
+      write_lock(parent);
+      write_lock(n);
+      replace_child(parent, n, NULL);
+      write_unlock(n);
+      write_unlock(parent);
+      count_up(parent, -1);
+    }
+    free_node(n);
+    return;
+  }
+
+  if(n->left() == NULL || n->right() == NULL) {
+    write_lock(parent);
+    write_lock(n);
+    replace_child(parent, n, m);
+    write_unlock(n);
+    write_unlock(parent);
+    free_node(n);
+
+    m->set_parent(parent);
+    count_up(parent, -1);
+    if(bb) {
+      fix_double_black(m);
+    }
+    else {
+      m->set_color(black);
+    }
+    return;
+  }
+
+  if(unlocked_readers()) {
+    // keys never change under a reader, so n is swapped for a copy
+    // holding the successor's entry. Optimistic readers already on
+    // their way to the successor notice it going and start over; RCU
+    // ones cannot, so the path down to the successor is copied too and
+    // goes in with n's copy, leaving them the old path, successor and
+    // all, until the grace period that frees it
+    node_p copy = copy_node(n, m);
+    if(mode == rcu) {
+      node_p above = copy;
+      for(node_p p = copy->right(); p != m; p = p->left()) {
+	node_p step = copy_node(p, p);
+	if(above == copy) above->set_right(step);
+	else above->set_left(step);
+	free_node(p);
+	above = p = step;
+      }
+    }
+    write_lock(parent);
+    write_lock(n);
+    replace_child(parent, n, copy);
+    write_unlock(n);
+    write_unlock(parent);
+    free_node(n);
+    delete_helper(m);
+    return;
+  }
+
+  // sweep an exclusive lock down to the successor so every reader
+  // already between n and m has moved past it before its key moves up
+  write_lock(n);
+  for(node_p p = n->right(); p != m; p = p->left()) {
+    write_lock(p);
+    write_unlock(p);
+  }
+  write_lock(m);
+  swap_keys(m, n);
+  write_unlock(m);
+  write_unlock(n);
+  delete_helper(m);
+}
+
+/**
+ * Helper function that perfoms an iterative binary search of
+ * the red-black tree, starting at node, to try and find the node
+ * with the given key.
+ * RETURNS the found node, NULL otherwise.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::search_helper(node_p node, const Key& key)
+{
+  while(node != NULL) {
+    if(compare(key, node->key)) node = node->left();
+    else if(compare(node->key, key)) node = node->right();
+    else break;
+  }
+
+  return node;
+}
+
+/**
+ * Rotates the tree right if there is inconsistencies
+ * in the structural integrity of the red-black tree.
+ */
+RB_TEMPLATE
+void RB_TREE::rotate_right(node_p& root, node_p& node)
+{
+  RB_COUNT(rotations);
+  if(mode == rcu) {
+    rotate_right_rcu(root, node);
+    return;
+  }
+
+  node_p left = node->left();
+  node_p anchor = node->parent();
+  write_lock(anchor);
+  write_lock(node);
+  write_lock(left);
+  hold(left->right());
+
+  link_left(node, left->right());
+
+  if(node->left() != NULL) {
+    node->left()->set_parent(node);
+  }
+
+  left->set_parent(node->parent());
+
+  if(node->parent() == NULL) {
+    link_root(left);
+  }
+  else if(node == node->parent()->left()) {
+    link_left(node->parent(), left);
+  }
+  else {
+    link_right(node->parent(), left);
+  }
+
+  link_right(left, node);
+  node->set_parent(left);
+  recount(node);
+  recount(left);
+
+  write_unlock(left);
+  write_unlock(node);
+  write_unlock(anchor);
+}
+
+/**
+ * Rotates the tree left if there is inconsistencies
+ * in the structural integrity of the red-black tree.
+ */
+RB_TEMPLATE
+void RB_TREE::rotate_left(node_p& root, node_p& node)
+{
+  RB_COUNT(rotations);
+  if(mode == rcu) {
+    rotate_left_rcu(root, node);
+    return;
+  }
+
+  node_p right = node->right();
+  node_p anchor = node->parent();
+  write_lock(anchor);
+  write_lock(node);
+  write_lock(right);
+  hold(right->left());
+
+  link_right(node, right->left());
+
+  if(node->right() != NULL) {
+    node->right()->set_parent(node);
+  }
+
+  right->set_parent(node->parent());
+
+  if(node->parent() == NULL) {
+    link_root(right);
+  }
+  else if(node == node->parent()->left()) {
+    link_left(node->parent(), right);
+  }
+  else {
+    link_right(node->parent(), right);
+  }
+
+  link_left(right, node);
+  node->set_parent(right);
+  recount(node);
+  recount(right);
+
+  write_unlock(right);
+  write_unlock(node);
+  write_unlock(anchor);
+}
+
+/**
+ * Rotates right without changing any node a reader might be
+ * standing on: the node that moves down is replaced by a copy
+ * that gets the new children, and the original is retired.
+ * node is updated to point at the copy.
+ */
+RB_TEMPLATE
+void RB_TREE::rotate_right_rcu(node_p& root, node_p& node)
+{
+  node_p left = node->left();
+  node_p copy = copy_node(node, node);
+
+  link_left(copy, left->right());
+  if(copy->left() != NULL) {
+    copy->left()->set_parent(copy);
+  }
+  copy->set_parent(left);
+  recount(copy);
+
+  // readers that come through the old node still find everything
+  link_right(left, copy);
+  recount(left);
+  left->set_parent(node->parent());
+  replace_child(node->parent(), node, left);
+
+  free_node(node);
+  node = copy;
+}
+
+/**
+ * Mirror image of rotate_right_rcu.
+ */
+RB_TEMPLATE
+void RB_TREE::rotate_left_rcu(node_p& root, node_p& node)
+{
+  node_p right = node->right();
+  node_p copy = copy_node(node, node);
+
+  link_right(copy, right->left());
+  if(copy->right() != NULL) {
+    copy->right()->set_parent(copy);
+  }
+  copy->set_parent(right);
+  recount(copy);
+
+  link_left(right, copy);
+  recount(right);
+  right->set_parent(node->parent());
+  replace_child(node->parent(), node, right);
+
+  free_node(node);
+  node = copy;
+}
+
+/**
+ * Allocates a new red node with the given entry from the
+ * tree's arena, creating the arena on first use.
+ * RETURNS the new node.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::new_node(const Key& key, const Value& value)
+{
+  bool shared = mode == lock_coupling;
+  if(shared) pthread_mutex_lock(&arena_lock);
+  if(arena == NULL) {
+    arena = new Alloc<node>();
+    if(numa_node >= 0) arena->bind(numa_node);
+  }
+  void* slot = arena->allocate();
+  if(shared) pthread_mutex_unlock(&arena_lock);
+  return new (slot) node(key, value);
+}
+
+/**
+ * Places the tree's nodes, the ones it already has included,
+ * in the memory of NUMA node node; with -1, an arena created
+ * later is left to first touch.
+ */
+RB_TEMPLATE
+void RB_TREE::set_numa_node(int node)
+{
+  numa_node = node;
+  if(arena != NULL && node >= 0) arena->bind(node);
+}
+
+/**
+ * Returns a node that is no longer reachable to the arena.
+ */
+RB_TEMPLATE
+void RB_TREE::destroy_node(node_p n)
+{
+  n->~node();
+  bool shared = mode == lock_coupling;
+  if(shared) pthread_mutex_lock(&arena_lock);
+  arena->deallocate(n);
+  if(shared) pthread_mutex_unlock(&arena_lock);
+}
+
+/**
+ * Creates an unpublished copy of n holding the key and
+ * value of from, and adopts n's children.
+ * RETURNS the copy.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::copy_node(node_p n, node_p from)
+{
+  node_p copy = new_node(from->key, from->value);
+  copy->set_color(n->color());
+  copy->set_parent(n->parent());
+  copy->set_left(n->left());
+  copy->set_right(n->right());
+#ifdef ORDER_STATISTICS
+  copy->subtree = n->subtree;
+#endif
+
+  if(copy->left() != NULL) {
+    copy->left()->set_parent(copy);
+  }
+  if(copy->right() != NULL) {
+    copy->right()->set_parent(copy);
+  }
+  return copy;
+}
+
+/**
+ * Stores child into a link readers may be following. When
+ * readers take no locks this is a release store, so a reader
+ * that loads the pointer also sees the node's contents.
+ */
+RB_TEMPLATE
+void RB_TREE::link_root(node_p child)
+{
+  if(unlocked_readers()) __atomic_store_n(&root, child, __ATOMIC_RELEASE);
+  else root = child;
+}
+
+/**
+ * Makes child the left child of parent, as above.
+ */
+RB_TEMPLATE
+void RB_TREE::link_left(node_p parent, node_p child)
+{
+  if(unlocked_readers()) parent->publish_left(child);
+  else parent->set_left(child);
+}
+
+/**
+ * Makes child the right child of parent, as above.
+ */
+RB_TEMPLATE
+void RB_TREE::link_right(node_p parent, node_p child)
+{
+  if(unlocked_readers()) parent->publish_right(child);
+  else parent->set_right(child);
+}
+
+/**
+ * Redirects the link from parent (or the root pointer if
+ * parent is NULL) that currently points at old to child.
+ */
+RB_TEMPLATE
+void RB_TREE::replace_child(node_p parent, node_p old, node_p child)
+{
+  if(parent == NULL) link_root(child);
+  else if(parent->left() == old) link_left(parent, child);
+  else link_right(parent, child);
+}
+
+/**
+ * Frees a node that has been unlinked from the tree.
+ * Readers that take no locks may still hold it, so then
+ * it is only retired and freed after the next grace period.
+ */
+RB_TEMPLATE
+void RB_TREE::free_node(node_p n)
+{
+  if(!unlocked_readers()) {
+    // waiting for the lock of a node takes holding its parent, so no
+    // one waits for an unlinked node's and it can be let go first
+    release(n);
+    destroy_node(n);
+    return;
+  }
+
+  retired.push_back(n);
+}
+
+/**
+ * Waits for the readers currently in the tree and frees
+ * batch, the nodes retired before they started. It runs
+ * outside the writer lock, so other writers go on while
+ * it waits, and takes the lock again only for the frees.
+ */
+RB_TEMPLATE
+void RB_TREE::reclaim(std::vector<node_p>& batch)
+{
+  epochs->synchronize();
+  pthread_rwlock_wrlock(&writer_lock);
+  for(unsigned i = 0; i < batch.size(); i++) {
+    destroy_node(batch[i]);
+  }
+  pthread_rwlock_unlock(&writer_lock);
+  batch.clear();
+}
+
+/**
+ * Helper function used to re-balance the 
+ * tree after an insert.
+ */
+RB_TEMPLATE
+void RB_TREE::fix_insert(node_p& root, node_p& node)
+{
+  node_p parent = NULL;
+  node_p grand_parent = NULL;
+
+  while((node->parent() != NULL) && (node->color() != black) &&
+	(node->parent()->color() == red)) {
+    parent = node->parent();
+    grand_parent = node->parent()->parent();
+
+    if(parent == grand_parent->left()) {
+      node_p uncle = grand_parent->right();
+      hold(uncle);
+
+      if(uncle != NULL && uncle->color() == red) {
+	grand_parent->set_color(red);
+	parent->set_color(black);
+	uncle->set_color(black);
+	node = grand_parent;
+	RB_COUNT(recolors);
+      }
+      else {
+	if(node == parent->right()) {
+	  rotate_left(root, parent);
+	  node = parent;
+	  parent = node->parent();
+	}
+
+	rotate_right(root, grand_parent);
+	parent->set_color(black);
+	grand_parent->set_color(red);
+	node = parent;
+      }
+    }
+    else {
+      node_p uncle = grand_parent->left();
+      hold(uncle);
+
+      if((uncle != NULL) && (uncle->color() == red)) {
+	grand_parent->set_color(red);
+	parent->set_color(black);
+	uncle->set_color(black);
+	node = grand_parent;
+	RB_COUNT(recolors);
+      }
+      else {
+	if(node == parent->left()) {
+	  rotate_right(root, parent);
+	  node = parent;
+	  parent = node->parent();
+	}
+
+	rotate_left(root, grand_parent);
+	parent->set_color(black);
+	grand_parent->set_color(red);
+	node = parent;
+      }
+    }
+  }
+
+  // only a node that has reached the top can have been left red there
+  if(node->parent() == NULL) node->set_color(black);
+}
+
+/**
+ * Inserts a node with the given key and value
+ * into the tree. A key that is already in the tree
+ * keeps the value it has.
+ */
+RB_TEMPLATE
+void RB_TREE::insert_node(const Key& key, const Value& value)
+{
+  begin_modify();
+  apply_insert(key, value);
+  end_modify();
+}
+
+/**
+ * Deletes a node from the tree
+ * with the given key.
+ */
+RB_TEMPLATE
+void RB_TREE::delete_node(const Key& key)
+{
+  begin_modify();
+  apply_erase(key, true);
+  end_modify();
+}
+
+/**
+ * Deletes the node with the given key, if there is one,
+ * without complaining when there is not.
+ * RETURNS whether a node was deleted.
+ */
+RB_TEMPLATE
+bool RB_TREE::erase(const Key& key)
+{
+  begin_modify();
+  bool erased = apply_erase(key, false);
+  end_modify();
+  return erased;
+}
+
+/**
+ * Helper function that inserts an entry for a writer that
+ * begin_modify has already let in, so one that is applying
+ * several operations, like a flat-combining sweep, holds the
+ * writer lock once for all of them.
+ */
+RB_TEMPLATE
+void RB_TREE::apply_insert(const Key& key, const Value& value)
+{
+  thaw();
+  node_p npt = insert_helper(NULL, key, value);
+  if(npt != NULL) {
+    fix_insert(root, npt);
+  }
+  release_held();
+}
+
+/**
+ * Helper function that deletes key for a writer that has
+ * already been let in, as above, complaining if complain is
+ * set and key is not in a tree that has nodes.
+ * RETURNS whether a node was deleted.
+ */
+RB_TEMPLATE
+bool RB_TREE::apply_erase(const Key& key, bool complain)
+{
+  thaw();
+  bool empty;
+  node_p n = find_victim(key, empty);
+  if(n != NULL) {
+    delete_helper(n);
+  }
+  release_held();
+
+  if(n == NULL && !empty && complain) {
+    std::cout << "Error: couldn't find " << key << "in the tree." << std::endl;
+  }
+  return n != NULL;
+}
+
+/**
+ * Finds where the descent for key can start when key is
+ * no smaller than the key of from: the lowest ancestor of
+ * from whose subtree covers key.
+ * RETURNS that node, NULL if the descent has to start at the root.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::climb(node_p from, const Key& key)
+{
+  node_p n = from;
+  while(n != NULL && n->parent() != NULL) {
+    node_p p = n->parent();
+    if(n == p->left() && compare(key, p->key)) return n;
+    n = p;
+  }
+  return NULL;
+}
+
+/**
+ * Inserts every key of the batch into the tree, see below.
+ */
+RB_TEMPLATE
+void RB_TREE::insert_batch(std::vector<Key> keys)
+{
+  std::vector<std::pair<Key, Value> > entries;
+  entries.reserve(keys.size());
+  for(unsigned i = 0; i < keys.size(); i++) {
+    entries.push_back(std::make_pair(keys[i], Value()));
+  }
+  insert_batch(entries);
+}
+
+/**
+ * Inserts a whole batch of entries while holding the writer
+ * lock once. The entries are sorted first, so each descent starts
+ * from the node inserted before it and only climbs as far up as
+ * the next key needs. A key that is repeated keeps its first value.
+ * Lock-coupling writers share the tree instead, so there every
+ * entry goes in on its own, in key order.
+ */
+RB_TEMPLATE
+void RB_TREE::insert_batch(std::vector<std::pair<Key, Value> > entries)
+{
+  Compare cmp = compare;
+  std::stable_sort(entries.begin(), entries.end(),
+		   [&cmp](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+		     return cmp(a.first, b.first);
+		   });
+
+  if(mode == lock_coupling) {
+    for(unsigned i = 0; i < entries.size(); i++) {
+      insert_node(entries[i].first, entries[i].second);
+    }
+    return;
+  }
+
+  begin_modify();
+  thaw();
+  node_p finger = NULL;
+  for(unsigned i = 0; i < entries.size(); i++) {
+    node_p npt = insert_helper(climb(finger, entries[i].first), entries[i].first, entries[i].second);
+    if(npt == NULL) continue;
+
+    // fix_insert moves npt up the tree, so the new node is kept first;
+    // RCU rotations only copy the nodes they move down, which are above
+    // it, so it stays in the tree with live ancestors in every mode
+    finger = npt;
+    fix_insert(root, npt);
+  }
+  end_modify();
+}
+
+/**
+ * Deletes a whole batch of keys while holding the writer
+ * lock once, or one at a time in lock-coupling mode, as above.
+ * Deleting in key order keeps the paths of consecutive
+ * descents mostly the same.
+ */
+RB_TEMPLATE
+void RB_TREE::delete_batch(std::vector<Key> keys)
+{
+  std::sort(keys.begin(), keys.end(), compare);
+
+  if(mode == lock_coupling) {
+    for(unsigned i = 0; i < keys.size(); i++) {
+      delete_node(keys[i]);
+    }
+    return;
+  }
+
+  begin_modify();
+  thaw();
+  for(unsigned i = 0; i < keys.size() && root != NULL; i++) {
+    node_p n = search_helper(root, keys[i]);
+    if(n == NULL) {
+      std::cout << "Error: couldn't find " << keys[i] << "in the tree." << std::endl;
+      continue;
+    }
+    delete_helper(n);
+  }
+  end_modify();
+}
+
+/**
+ * Searches the tree for a node
+ * with the given key.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::search_tree(const Key& key)
+{
+  node_p n = NULL;
+  if(search_frozen(&key, 1, &n, NULL)) {
+    return n;
+  }
+  if(mode == lock_coupling) {
+    return search_coupled(key, NULL);
+  }
+  if(mode == rcu) {
+    return search_rcu(key, NULL);
+  }
+  if(mode == optimistic) {
+    return search_optimistic(key, NULL);
+  }
+  return search_helper(root, key);
+}
+
+/**
+ * Looks up the value mapped to key in a single traversal.
+ * The value is copied out while the node is still protected,
+ * so unlike the node returned by search_tree it stays valid
+ * in every lock mode.
+ * RETURNS true and sets value if key is in the tree,
+ * false otherwise.
+ */
+RB_TEMPLATE
+bool RB_TREE::lookup(const Key& key, Value& value)
+{
+  node_p found = NULL;
+  if(search_frozen(&key, 1, &found, &value)) {
+    return found != NULL;
+  }
+  if(mode == lock_coupling) {
+    return search_coupled(key, &value) != NULL;
+  }
+  if(mode == rcu) {
+    return search_rcu(key, &value) != NULL;
+  }
+  if(mode == optimistic) {
+    return search_optimistic(key, &value) != NULL;
+  }
+
+  node_p n = search_helper(root, key);
+  if(n == NULL) return false;
+  value = n->value;
+  return true;
+}
+
+/**
+ * Searches the tree for every key in keys, walking up to
+ * SEARCH_GROUP lookups in lockstep. Each step of a lookup
+ * prefetches the child it goes to next, so by the time the
+ * other lookups have taken their step the child is usually in
+ * the cache; a lookup that finishes hands its slot to the next
+ * key. In RCU mode the whole batch is one read-side section.
+ * Lock-coupled readers cannot hold locks for several paths at
+ * once without risking a deadlock with a writer, and optimistic
+ * ones start over on their own, so in those modes the keys are
+ * simply looked up one after another. A frozen tree is searched
+ * through its frozen copy instead, in every mode.
+ * RETURNS the found node for each key, NULL where there is none,
+ * with the same lifetime as the node returned by search_tree.
+ */
+RB_TEMPLATE
+std::vector<typename RB_TREE::node_p> RB_TREE::search_many(const std::vector<Key>& keys)
+{
+  std::vector<node_p> found(keys.size(), NULL);
+  if(search_frozen(keys.data(), keys.size(), found.data(), NULL)) {
+    return found;
+  }
+  if(mode == lock_coupling || mode == optimistic) {
+    for(unsigned i = 0; i < keys.size(); i++) {
+      found[i] = search_tree(keys[i]);
+    }
+    return found;
+  }
+
+  bool acquire = mode == rcu;
+  if(acquire) epochs->read_lock();
+
+  node_p at[SEARCH_GROUP];
+  unsigned which[SEARCH_GROUP];
+  unsigned next = 0;
+  int active = 0;
+
+  // a slot whose index is keys.size() is idle
+  for(int g = 0; g < SEARCH_GROUP; g++) {
+    at[g] = NULL;
+    which[g] = keys.size();
+    if(next < keys.size()) {
+      which[g] = next++;
+      at[g] = acquire ? __atomic_load_n(&root, __ATOMIC_ACQUIRE) : root;
+      active++;
+    }
+  }
+
+  while(active > 0) {
+    for(int g = 0; g < SEARCH_GROUP; g++) {
+      if(which[g] == keys.size()) continue;
+
+      node_p n = at[g];
+      const Key& key = keys[which[g]];
+      if(n != NULL) {
+	if(compare(key, n->key)) n = acquire ? n->left_acquire() : n->left();
+	else if(compare(n->key, key)) n = acquire ? n->right_acquire() : n->right();
+	else {
+	  found[which[g]] = n;
+	  n = NULL;
+	}
+
+	if(n != NULL) {
+	  __builtin_prefetch(n);
+	  at[g] = n;
+	  continue;
+	}
+      }
+
+      // this lookup is done; start the next one in its slot
+      if(next < keys.size()) {
+	which[g] = next++;
+	at[g] = acquire ? __atomic_load_n(&root, __ATOMIC_ACQUIRE) : root;
+	__builtin_prefetch(at[g]);
+      }
+      else {
+	which[g] = keys.size();
+	active--;
+      }
+    }
+  }
+
+  if(acquire) epochs->read_unlock();
+  return found;
+}
+
+/**
+ * Searches the tree without taking any lock. Writers never
+ * change a published node's key or restructure a node in place,
+ * so every pointer a reader loads leads to a consistent subtree.
+ * If value is not NULL the found node's value is copied into it.
+ * RETURNS the found node, NULL otherwise; the node is only
+ * guaranteed to stay allocated until the next grace period.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::search_rcu(const Key& key, Value* value)
+{
+  epochs->read_lock();
+  node_p n = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+  while(n != NULL) {
+    if(compare(key, n->key)) n = n->left_acquire();
+    else if(compare(n->key, key)) n = n->right_acquire();
+    else break;
+  }
+  if(n != NULL && value != NULL) *value = n->value;
+  epochs->read_unlock();
+
+  return n;
+}
+
+/**
+ * Searches the tree without taking any lock or storing to
+ * anything but the reader's own epoch slot. Writers change
+ * nodes in place, but bump the version in a node's lock word
+ * around every change to its links, and the root lock's around
+ * changes to the root pointer. A reader checks that the node
+ * it came from is still unchanged once it has the version of
+ * the next one, so it knows it followed a link that was there;
+ * if a writer got in the way, the descent starts over. Nodes
+ * are reclaimed as in RCU mode, so a stale one is still safe
+ * to read. If value is not NULL the found node's value is
+ * copied into it.
+ * RETURNS the found node, NULL otherwise, with the same
+ * lifetime as in RCU mode.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::search_optimistic(const Key& key, Value* value)
+{
+  epochs->read_lock();
+  node_p n;
+  while(true) {
+    rw_spinlock* from = &root_lock;
+    unsigned version = from->stable_version();
+    n = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+    bool stale = false;
+
+    while(n != NULL) {
+      unsigned next = lock_of(n).stable_version();
+      if(!from->validate(version)) {
+	stale = true;
+	break;
+      }
+      from = &lock_of(n);
+      version = next;
+
+      if(compare(key, n->key)) n = n->left_acquire();
+      else if(compare(n->key, key)) n = n->right_acquire();
+      else break;
+    }
+
+    // a miss is only real if the missing link was still missing
+    if(!stale && (n != NULL || from->validate(version))) break;
+    RB_COUNT(retries);
+  }
+  if(n != NULL && value != NULL) *value = n->value;
+  epochs->read_unlock();
+
+  return n;
+}
+
+/**
+ * Makes a read-only copy of the keys in Eytzinger order, which
+ * searches use until the next write makes it stale. For a tree
+ * that is done changing for a while, every search then costs a
+ * few branch-free steps through one array instead of a descent
+ * through the nodes. Freezing a tree that is already frozen does
+ * nothing. In global mode the caller has to hold the whole-tree
+ * lock, as for any write.
+ */
+RB_TEMPLATE
+void RB_TREE::freeze()
+{
+  begin_modify(true);
+  if(frozen == NULL) {
+    size_t count = 0;
+    for(iterator it = begin(); it != end(); ++it) count++;
+
+    iterator it = begin();
+    frozen_index<Key, node_p, Compare>* f = new frozen_index<Key, node_p, Compare>(count,
+      [&it](Key& key, node_p& ref) {
+	key = it->key;
+	ref = &*it;
+	++it;
+      });
+    __atomic_store_n(&frozen, f, __ATOMIC_RELEASE);
+  }
+  end_modify();
+}
+
+/**
+ * Drops the frozen copy before a write. Outside of global mode
+ * readers may still be searching it, so it is only freed once they
+ * are done, which is also before any node it points to can go.
+ */
+RB_TEMPLATE
+void RB_TREE::thaw()
+{
+  if(__atomic_load_n(&frozen, __ATOMIC_RELAXED) == NULL) return;
+  frozen_index<Key, node_p, Compare>* f =
+    __atomic_exchange_n(&frozen, (frozen_index<Key, node_p, Compare>*) NULL, __ATOMIC_ACQ_REL);
+  if(f == NULL) return;
+
+  if(mode != global_lock) epochs->synchronize();
+  delete f;
+}
+
+/**
+ * Searches the frozen copy for count keys, if there is one. If
+ * value is not NULL, the value of the first key's node is copied
+ * into it while that node is still protected.
+ * RETURNS false if the tree is not frozen, in which case found
+ * is left alone.
+ */
+RB_TEMPLATE
+bool RB_TREE::search_frozen(const Key* keys, size_t count, node_p* found, Value* value)
+{
+  if(__atomic_load_n(&frozen, __ATOMIC_RELAXED) == NULL) return false;
+
+  bool global = mode == global_lock;
+  if(!global) epochs->read_lock();
+  frozen_index<Key, node_p, Compare>* f = __atomic_load_n(&frozen, __ATOMIC_ACQUIRE);
+  if(f != NULL) {
+    f->search(keys, count, found, NULL);
+    if(value != NULL && found[0] != NULL) *value = found[0]->value;
+  }
+  if(!global) epochs->read_unlock();
+
+  return f != NULL;
+}
+
+/**
+ * RETURNS the first node whose key is not smaller than key,
+ * or, if strict, the first one whose key is larger; NULL if
+ * there is no such node.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::bound(const Key& key, bool strict)
+{
+  node_p n = root, found = NULL;
+  while(n != NULL) {
+    if(strict ? compare(key, n->key) : !compare(n->key, key)) {
+      found = n;
+      n = n->left();
+    }
+    else {
+      n = n->right();
+    }
+  }
+  return found;
+}
+
+/**
+ * Calls callback(key, value) for every entry with a key in
+ * [lo, hi], in key order, under a single read acquisition. In
+ * global mode that is the caller's hold of the whole-tree lock.
+ * In the other modes the scan takes the lock that serializes
+ * writers, so searches carry on while it runs but writers wait
+ * for it; a scan racing rotations could skip or repeat keys.
+ * RETURNS the number of entries visited.
+ */
+RB_TEMPLATE
+template <class F>
+size_t RB_TREE::range_scan(const Key& lo, const Key& hi, F callback)
+{
+  begin_modify();
+  size_t visited = 0;
+  for(iterator it = lower_bound(lo); it != end() && !compare(hi, it->key); ++it) {
+    callback(it->key, it->value);
+    visited++;
+  }
+  end_modify();
+
+  return visited;
+}
+
+/**
+ * RETURNS the number of keys in [lo, hi].
+ */
+RB_TEMPLATE
+size_t RB_TREE::count_range(const Key& lo, const Key& hi)
+{
+  return range_scan(lo, hi, [](const Key&, const Value&) {});
+}
+
+/**
+ * RETURNS the number of nodes below and including n;
+ * without -DORDER_STATISTICS it is always 0.
+ */
+RB_TEMPLATE
+size_t RB_TREE::subtree_size(node_p n)
+{
+#ifdef ORDER_STATISTICS
+  if(n != NULL) return n->subtree;
+#endif
+  return 0;
+}
+
+/**
+ * Recomputes the subtree count of n from its children,
+ * after a rotation has given it new ones.
+ */
+RB_TEMPLATE
+void RB_TREE::recount(node_p n)
+{
+#ifdef ORDER_STATISTICS
+  n->subtree = 1 + subtree_size(n->left()) + subtree_size(n->right());
+#endif
+}
+
+/**
+ * Adds delta to the subtree count of from and of
+ * every one of its ancestors, after a node has been
+ * linked in below from or unlinked from it.
+ */
+RB_TEMPLATE
+void RB_TREE::count_up(node_p from, int delta)
+{
+#ifdef ORDER_STATISTICS
+  for(node_p p = from; p != NULL; p = p->parent()) {
+    p->subtree += delta;
+  }
+#endif
+}
+
+#ifdef ORDER_STATISTICS
+/**
+ * Finds the k-th smallest key, counting from 0, by
+ * descending along the subtree counts. Like range_scan it
+ * relies on the caller's global lock, or keeps writers out.
+ * RETURNS its node, NULL if the tree has no more than k keys.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::select(size_t k)
+{
+  begin_modify();
+  node_p n = root;
+  while(n != NULL) {
+    size_t left = subtree_size(n->left());
+    if(k < left) {
+      n = n->left();
+    }
+    else if(k == left) {
+      break;
+    }
+    else {
+      k -= left + 1;
+      n = n->right();
+    }
+  }
+  end_modify();
+
+  return n;
+}
+
+/**
+ * RETURNS the number of keys in the tree that are smaller
+ * than key, whether key is in the tree or not.
+ */
+RB_TEMPLATE
+size_t RB_TREE::rank(const Key& key)
+{
+  begin_modify();
+  size_t smaller = 0;
+  node_p n = root;
+  while(n != NULL) {
+    if(compare(n->key, key)) {
+      smaller += subtree_size(n->left()) + 1;
+      n = n->right();
+    }
+    else {
+      n = n->left();
+    }
+  }
+  end_modify();
+
+  return smaller;
+}
+
+/**
+ * RETURNS the number of keys in the tree.
+ */
+RB_TEMPLATE
+size_t RB_TREE::size()
+{
+  begin_modify();
+  size_t n = subtree_size(root);
+  end_modify();
+
+  return n;
+}
+#endif
+
+/**
+ * Searches the tree hand-over-hand: the lock on a child
+ * is taken before the lock on its parent is dropped, so a
+ * reader never steps into a subtree that is being rotated.
+ * If value is not NULL the found node's value is copied into it.
+ * RETURNS the found node, NULL otherwise; the node is no
+ * longer locked once it has been returned.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::search_coupled(const Key& key, Value* value)
+{
+  root_lock.lock_shared();
+  node_p n = root;
+  if(n == NULL) {
+    root_lock.unlock_shared();
+    return NULL;
+  }
+  lock_of(n).lock_shared();
+  root_lock.unlock_shared();
+
+  while(compare(key, n->key) || compare(n->key, key)) {
+    node_p next = compare(key, n->key) ? n->left() : n->right();
+    if(next == NULL) {
+      lock_of(n).unlock_shared();
+      return NULL;
+    }
+    lock_of(next).lock_shared();
+    lock_of(n).unlock_shared();
+    n = next;
+  }
+  if(value != NULL) *value = n->value;
+  lock_of(n).unlock_shared();
+
+  return n;
+}
+
+/**
+ * RETURNS whether the node layout lets the tree run in mode m:
+ * compact nodes have no lock, so they only run in the modes
+ * that never lock a single node.
+ */
+RB_TEMPLATE
+bool RB_TREE::supports(lock_mode m)
+{
+#ifdef COMPACT_NODES
+  return m == global_lock || m == rcu;
+#else
+  return true;
+#endif
+}
+
+/**
+ * Switches the tree to mode m, while no other thread uses it.
+ * RETURNS false, leaving the mode as it was, if the node
+ * layout does not support m, see supports.
+ */
+RB_TEMPLATE
+bool RB_TREE::set_lock_mode(lock_mode m)
+{
+  if(!supports(m)) return false;
+  mode = m;
+  return true;
+}
+
+/**
+ * RETURNS the lock of node, or the one guarding the root
+ * pointer if node is NULL. Only the modes supports turns
+ * down for compact nodes ask for one, so there is none to
+ * return in that layout.
+ */
+RB_TEMPLATE
+rw_spinlock& RB_TREE::lock_of(node_p node)
+{
+  if(node == NULL) return root_lock;
+#ifdef COMPACT_NODES
+  abort();
+#else
+  return node->lock;
+#endif
+}
+
+/**
+ * In optimistic mode, marks the version of a node whose child
+ * pointers or key are about to change; in lock-coupling mode,
+ * makes sure the writer holds its lock, see hold. A NULL node
+ * stands for the root pointer.
+ */
+RB_TEMPLATE
+void RB_TREE::write_lock(node_p node)
+{
+  if(mode == lock_coupling) hold(lock_of(node));
+  else if(mode == optimistic) lock_of(node).begin_change();
+}
+
+/**
+ * Releases a version mark taken by write_lock. Lock-coupling
+ * writers keep their locks until their change is done.
+ */
+RB_TEMPLATE
+void RB_TREE::write_unlock(node_p node)
+{
+  if(mode == optimistic) lock_of(node).end_change();
+}
+
+/**
+ * RETURNS the locks the calling lock-coupling writer holds,
+ * in the order it took them.
+ */
+RB_TEMPLATE
+std::vector<rw_spinlock*>& RB_TREE::held()
+{
+  static thread_local std::vector<rw_spinlock*> locks;
+  return locks;
+}
+
+/**
+ * In lock-coupling mode, exclusively locks lock for the rest of
+ * the calling writer's change, unless it holds it already; other
+ * modes take no node locks here. A writer only ever locks the
+ * root pointer or a child of a node it holds, top-down like the
+ * readers, so writers whose changes are far apart never wait on
+ * each other, and no two of them can wait on each other at once.
+ */
+RB_TEMPLATE
+void RB_TREE::hold(rw_spinlock& lock)
+{
+  if(mode != lock_coupling) return;
+  std::vector<rw_spinlock*>& locks = held();
+  for(unsigned i = 0; i < locks.size(); i++) {
+    if(locks[i] == &lock) return;
+  }
+  lock.lock();
+  locks.push_back(&lock);
+}
+
+/**
+ * Holds the lock of node as above; a node about to be read
+ * or changed off the writer's path goes through here first.
+ * A NULL node is skipped.
+ */
+RB_TEMPLATE
+void RB_TREE::hold(node_p node)
+{
+  if(mode == lock_coupling && node != NULL) hold(lock_of(node));
+}
+
+/**
+ * Lets a lock-coupling writer that is still on its way down
+ * drop every lock it took before the one of node, once it knows
+ * its change stays at node or below it. A NULL node, standing
+ * for the root pointer, keeps everything. With ORDER_STATISTICS
+ * every change counts up to the root, so nothing is dropped.
+ */
+RB_TEMPLATE
+void RB_TREE::release_above(node_p node)
+{
+#ifndef ORDER_STATISTICS
+  if(mode != lock_coupling || node == NULL) return;
+  std::vector<rw_spinlock*>& locks = held();
+  rw_spinlock* top = &lock_of(node);
+  unsigned above = 0;
+  while(above < locks.size() && locks[above] != top) above++;
+  if(above == locks.size()) return;
+  for(unsigned i = 0; i < above; i++) {
+    locks[i]->unlock();
+  }
+  locks.erase(locks.begin(), locks.begin() + above);
+#endif
+}
+
+/**
+ * Releases the lock of node if the calling lock-coupling
+ * writer holds it.
+ */
+RB_TEMPLATE
+void RB_TREE::release(node_p node)
+{
+  if(mode != lock_coupling) return;
+  std::vector<rw_spinlock*>& locks = held();
+  for(unsigned i = 0; i < locks.size(); i++) {
+    if(locks[i] == &lock_of(node)) {
+      locks[i]->unlock();
+      locks.erase(locks.begin() + i);
+      return;
+    }
+  }
+}
+
+/**
+ * Releases every lock the calling lock-coupling writer holds,
+ * once its change is done.
+ */
+RB_TEMPLATE
+void RB_TREE::release_held()
+{
+  if(mode != lock_coupling) return;
+  std::vector<rw_spinlock*>& locks = held();
+  for(unsigned i = 0; i < locks.size(); i++) {
+    locks[i]->unlock();
+  }
+  locks.clear();
+}
+
+/**
+ * Finds the node holding key for a delete, setting empty if the
+ * tree has no nodes at all. A lock-coupling writer locks the path
+ * down to it, and on to its successor if it has two children, as
+ * that is the node that goes. The fix-up after a delete stops at
+ * the first red node above the one removed, so below a red node
+ * every lock above its parent can go, but never the node whose
+ * key is about to be replaced by the successor's.
+ * RETURNS the node, NULL if key is not in the tree.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::find_victim(const Key& key, bool& empty)
+{
+  if(mode != lock_coupling) {
+    empty = root == NULL;
+    return empty ? NULL : search_helper(root, key);
+  }
+
+  hold(root_lock);
+  empty = root == NULL;
+  node_p parent = NULL;
+  node_p n = root;
+  while(n != NULL) {
+    hold(n);
+    if(n->color() == red) release_above(parent);
+    if(compare(key, n->key)) {
+      parent = n;
+      n = n->left();
+    }
+    else if(compare(n->key, key)) {
+      parent = n;
+      n = n->right();
+    }
+    else break;
+  }
+
+  if(n != NULL && n->left() != NULL && n->right() != NULL) {
+    for(node_p p = n->right(); p != NULL; p = p->left()) {
+      hold(p);
+      if(p->color() == red) release_above(n);
+    }
+  }
+  return n;
+}
+
+/**
+ * Lets a writer in. Lock-coupling writers share the gate and
+ * only wait for each other on the nodes they lock, see hold;
+ * a frozen copy is thawed with the gate held exclusively, so no
+ * other writer frees a node that a search of the copy may still
+ * reach. Writers in the rcu and optimistic modes, and callers
+ * that pass exclusive because they need the tree to themselves,
+ * run one at a time. Readers keep going in every mode but the
+ * global one and at most wait on the nodes a writer is changing.
+ */
+RB_TEMPLATE
+void RB_TREE::begin_modify(bool exclusive)
+{
+  if(mode == global_lock) return;
+  if(mode != lock_coupling || exclusive) {
+    pthread_rwlock_wrlock(&writer_lock);
+    return;
+  }
+
+  pthread_rwlock_rdlock(&writer_lock);
+  while(is_frozen()) {
+    pthread_rwlock_unlock(&writer_lock);
+    pthread_rwlock_wrlock(&writer_lock);
+    thaw();
+    pthread_rwlock_unlock(&writer_lock);
+    pthread_rwlock_rdlock(&writer_lock);
+  }
+}
+
+/**
+ * Lets the next writer in. Once RETIRE_BATCH nodes have been
+ * retired they are taken along and reclaimed after the gate
+ * is released, so no writer waits on readers while holding it.
+ */
+RB_TEMPLATE
+void RB_TREE::end_modify()
+{
+  if(mode == global_lock) return;
+  std::vector<node_p> batch;
+  if(retired.size() >= RETIRE_BATCH) batch.swap(retired);
+  pthread_rwlock_unlock(&writer_lock);
+  if(!batch.empty()) reclaim(batch);
+}
+
+/**
+ * Prints the skeleton of the tree.
+ */
+RB_TEMPLATE
+void RB_TREE::print_tree()
+{
+  if(root != NULL) {
+    print_tree_helper(this->root, "", true);
+  }
+}
+
+/**
+ * Builds the initial red-black tree from its prefix order,
+ * since the input file is said to always be a valid red
+ * black tree.
+ * RETURNS false, leaving the tree empty, if prefix is not the
+ * prefix order of a binary search tree, see build_push.
+ */
+RB_TEMPLATE
+bool RB_TREE::build_tree(const std::vector<rb_tmp_node<Key> >& prefix)
+{
+  for(unsigned i = 0; i < prefix.size(); i++) {
+    if(!build_push(prefix[i].key, prefix[i].color)) return false;
+  }
+  build_finish();
+  return true;
+}
+
+/**
+ * Adds the next node of a prefix order to a tree that is being
+ * built, so a parser can feed the tree as it goes and call
+ * build_finish at the end; it must not be mixed with any other
+ * change to the tree. build_path holds the nodes whose right
+ * subtree is still open: a key smaller than the last one is its
+ * left child, otherwise it is the right child of the last node on
+ * the path that is smaller than it. Every key after that has to
+ * be greater than that parent, since it can only go into its
+ * right subtree; build_low keeps the greatest such bound.
+ * Every node is linked exactly once, so a build is linear, and the
+ * nodes are allocated from the arena in prefix order, which puts
+ * a node right next to its left child. Subtree counts are left
+ * at 1 until build_finish.
+ * RETURNS false if key repeats a key on the path, no node on it
+ * is smaller than key, or key is not above build_low, which no
+ * prefix order of a binary search tree can have; the nodes
+ * built so far are then freed and the tree is left empty. A
+ * tree that is not being built is left as it was.
+ */
+RB_TEMPLATE
+bool RB_TREE::build_push(const Key& key, bool color, const Value& value)
+{
+  thaw();
+  node_p parent = NULL;
+  bool left = false;
+
+  if(root != NULL) {
+    if(build_path.empty()) return false;
+    if(has_low && !compare(build_low, key)) {
+      build_discard();
+      return false;
+    }
+    left = compare(key, build_path.back()->key);
+    if(!left) {
+      size_t open = build_path.size();
+      while(open > 0 && compare(build_path[open - 1]->key, key)) open--;
+      // the node left on the path bounds the new key from above
+      if(open == build_path.size() || (open > 0 && !compare(key, build_path[open - 1]->key))) {
+	build_discard();
+	return false;
+      }
+      parent = build_path[open];
+      build_path.resize(open);
+      build_low = parent->key;
+      has_low = true;
+    }
+    else {
+      parent = build_path.back();
+    }
+  }
+
+  node_p n = new_node(key, value);
+  n->set_color(color);
+
+  if(parent == NULL) {
+    root = n;
+    build_path.clear();
+    has_low = false;
+  }
+  else {
+    last_key = key;
+    has_last = true;
+    if(left) parent->set_left(n);
+    else parent->set_right(n);
+    n->set_parent(parent);
+  }
+  build_path.push_back(n);
+  return true;
+}
+
+/**
+ * Helper function that frees every node of a build that
+ * failed part way, without recursing since a rejected
+ * prefix can be a long chain, and leaves the tree empty.
+ */
+RB_TEMPLATE
+void RB_TREE::build_discard()
+{
+  std::vector<node_p> pending;
+  if(root != NULL) pending.push_back(root);
+  while(!pending.empty()) {
+    node_p n = pending.back();
+    pending.pop_back();
+    if(n->left() != NULL) pending.push_back(n->left());
+    if(n->right() != NULL) pending.push_back(n->right());
+    destroy_node(n);
+  }
+  root = NULL;
+  build_path.clear();
+  has_low = false;
+  has_last = false;
+}
+
+/**
+ * Ends a build fed through build_push. With ORDER_STATISTICS
+ * it fills in the subtree counts in one pass: every node comes
+ * after its parent in level order, so walking that order
+ * backwards counts the children before their parents.
+ */
+RB_TEMPLATE
+void RB_TREE::build_finish()
+{
+  build_path.clear();
+  has_low = false;
+#ifdef ORDER_STATISTICS
+  std::vector<node_p> order;
+  if(root != NULL) order.push_back(root);
+  for(size_t i = 0; i < order.size(); i++) {
+    if(order[i]->left() != NULL) order.push_back(order[i]->left());
+    if(order[i]->right() != NULL) order.push_back(order[i]->right());
+  }
+  for(size_t i = order.size(); i-- > 0;) {
+    recount(order[i]);
+  }
+#endif
+}
+
+/**
+ * Builds the tree from a list of keys that is sorted
+ * and has no duplicates, see below.
+ */
+RB_TEMPLATE
+void RB_TREE::build_sorted(const std::vector<Key>& keys)
+{
+  std::vector<std::pair<Key, Value> > entries;
+  entries.reserve(keys.size());
+  for(unsigned i = 0; i < keys.size(); i++) {
+    entries.push_back(std::make_pair(keys[i], Value()));
+  }
+  build_sorted(entries);
+}
+
+/**
+ * Builds an empty tree from a list of entries that is sorted
+ * by key and has no duplicates, in linear time. The middle entry
+ * becomes the root and each half becomes a subtree, so all the
+ * leaves end up on the last two levels. Coloring just the deepest
+ * level red then gives every path the same number of black nodes.
+ */
+RB_TEMPLATE
+void RB_TREE::build_sorted(const std::vector<std::pair<Key, Value> >& entries)
+{
+  thaw();
+  int red_depth = 0;
+  while(((size_t) 2 << red_depth) <= entries.size()) {
+    red_depth++;
+  }
+
+  root = build_sorted_helper(entries, 0, (long) entries.size() - 1, 0, red_depth);
+  if(root != NULL) {
+    root->set_color(black);
+  }
+}
+
+/**
+ * Helper function that builds the subtree for
+ * entries[lo..hi], a node before its children.
+ * RETURNS the root of the subtree.
+ */
+RB_TEMPLATE
+typename RB_TREE::node_p RB_TREE::build_sorted_helper(const std::vector<std::pair<Key, Value> >& entries,
+							long lo, long hi, int depth, int red_depth)
+{
+  if(lo > hi) return NULL;
+
+  long mid = lo + (hi - lo) / 2;
+  node_p n = new_node(entries[mid].first, entries[mid].second);
+  n->set_color(depth == red_depth ? red : black);
+
+  n->set_left(build_sorted_helper(entries, lo, mid - 1, depth + 1, red_depth));
+  if(n->left() != NULL) {
+    n->left()->set_parent(n);
+  }
+  n->set_right(build_sorted_helper(entries, mid + 1, hi, depth + 1, red_depth));
+  if(n->right() != NULL) {
+    n->right()->set_parent(n);
+  }
+  recount(n);
+  return n;
+}
+
+/**
+ * Writes the tree to path as a binary snapshot with a single
+ * write, so it can be loaded again without any parsing. Writers
+ * must be kept out of the tree while it is being saved.
+ * RETURNS true if the whole snapshot was written.
+ */
+RB_TEMPLATE
+bool RB_TREE::save_snapshot(const std::string& path)
+{
+  static_assert(std::is_trivially_copyable<Key>::value &&
+		std::is_trivially_copyable<Value>::value,
+		"snapshots store keys and values as raw bytes");
+
+  std::vector<node_p> prefix;
+  std::vector<node_p> stack;
+  if(root != NULL) stack.push_back(root);
+  while(!stack.empty()) {
+    node_p n = stack.back();
+    stack.pop_back();
+    prefix.push_back(n);
+    if(n->right() != NULL) stack.push_back(n->right());
+    if(n->left() != NULL) stack.push_back(n->left());
+  }
+
+  size_t count = prefix.size();
+  size_t value_size = std::is_empty<Value>::value ? 0 : sizeof(Value);
+  size_t keys = sizeof(rb_snapshot_header);
+  size_t values = keys + count * sizeof(Key);
+  size_t colors = values + count * value_size;
+  std::vector<char> buf(colors + (count + 7) / 8, 0);
+
+  rb_snapshot_header h;
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.key_size = sizeof(Key);
+  h.value_size = value_size;
+  h.count = count;
+  memcpy(&buf[0], &h, sizeof(h));
+
+  for(size_t i = 0; i < count; i++) {
+    memcpy(&buf[keys + i * sizeof(Key)], &prefix[i]->key, sizeof(Key));
+    if(value_size != 0) {
+      memcpy(&buf[values + i * value_size], &prefix[i]->value, value_size);
+    }
+    if(prefix[i]->color() == black) {
+      buf[colors + i / 8] |= 1 << (i % 8);
+    }
+  }
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return false;
+
+  size_t done = 0;
+  while(done < buf.size()) {
+    ssize_t w = write(fd, &buf[done], buf.size() - done);
+    if(w <= 0) {
+      close(fd);
+      return false;
+    }
+    done += w;
+  }
+  return close(fd) == 0;
+}
+
+/**
+ * Loads a snapshot written by save_snapshot into an empty
+ * tree. The file is mapped into memory and the nodes are
+ * built straight from it in linear time; build_push checks
+ * that the keys come in the prefix order of a binary search
+ * tree, so a corrupt file is not taken for a tree.
+ * RETURNS false if the tree is not empty, or if the file is
+ * not a snapshot of a tree with this key and value type, in
+ * which case none of it is kept and the tree stays empty.
+ */
+RB_TEMPLATE
+bool RB_TREE::load_snapshot(const std::string& path)
+{
+  if(root != NULL) return false;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(rb_snapshot_header)) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return false;
+
+  const char* data = (const char*) map;
+  rb_snapshot_header h;
+  memcpy(&h, data, sizeof(h));
+
+  size_t value_size = std::is_empty<Value>::value ? 0 : sizeof(Value);
+  size_t keys = sizeof(rb_snapshot_header);
+  size_t values = keys + h.count * sizeof(Key);
+  size_t colors = values + h.count * value_size;
+
+  bool ok = memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) == 0 &&
+    h.key_size == sizeof(Key) && h.value_size == value_size &&
+    h.count <= (size_t) st.st_size &&
+    (size_t) st.st_size == colors + (h.count + 7) / 8;
+
+  for(size_t i = 0; ok && i < h.count; i++) {
+    Key key;
+    Value value = Value();
+    memcpy(&key, data + keys + i * sizeof(Key), sizeof(Key));
+    if(value_size != 0) {
+      memcpy(&value, data + values + i * value_size, value_size);
+    }
+    bool color = (data[colors + i / 8] >> (i % 8)) & 1 ? black : red;
+    ok = build_push(key, color, value);
+  }
+  if(ok) build_finish();
+  else build_discard();
+
+  munmap(map, st.st_size);
+  return ok;
+}
+
+#endif
@@ -0,0 +1,526 @@
+#ifndef _RW_LOCK_H
+ # define _RW_LOCK_H
+
+#include <atomic>
+#include <string>
+#include <climits>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "rb_stats.h"
+
+// upper bound on the number of threads that can hold a reader_id at once
+#define MAX_READERS 256
+
+/**
+ * Hands out a small per-thread id the first time a
+ * thread asks for one and gives it back when the thread
+ * exits, so per-reader slots can be plain array entries.
+ */
+class reader_id {
+private:
+  int id;
+  static inline std::atomic<bool> in_use[MAX_READERS];
+
+public:
+  static inline std::atomic<int> high_water{0};
+
+  reader_id()
+  {
+    id = 0;
+    while(true) {
+      bool expected = false;
+      if(in_use[id].compare_exchange_strong(expected, true)) break;
+      if(++id == MAX_READERS) {
+	id = 0;
+	sched_yield();
+      }
+    }
+    int hw = high_water.load();
+    while(hw <= id && !high_water.compare_exchange_weak(hw, id + 1)) {}
+  }
+  ~reader_id() { in_use[id].store(false); }
+
+  /**
+   * RETURNS the calling thread's id.
+   */
+  static int self()
+  {
+    static thread_local reader_id mine;
+    return mine.id;
+  }
+};
+
+/**
+ * A reader-writer spinlock that fits in a single
+ * 32-bit word so one can be embedded in every node.
+ * A waiting writer sets the pending bit, which keeps
+ * new readers out until it has had its turn.
+ */
+class rw_spinlock {
+private:
+  enum { WRITER = 1, PENDING = 2, READER = 4 };
+  std::atomic<unsigned> word;
+
+  static void backoff(int& spins)
+  {
+    if(++spins > 64) {
+      spins = 0;
+      sched_yield();
+    }
+  }
+
+public:
+  rw_spinlock() : word(0) {}
+
+  void lock_shared()
+  {
+    int spins = 0;
+    while(true) {
+      unsigned w = word.load(std::memory_order_relaxed);
+      if(!(w & (WRITER | PENDING)) &&
+	 word.compare_exchange_weak(w, w + READER, std::memory_order_acquire)) {
+	return;
+      }
+      backoff(spins);
+    }
+  }
+
+  void unlock_shared()
+  {
+    word.fetch_sub(READER, std::memory_order_release);
+  }
+
+  void lock()
+  {
+    int spins = 0;
+    while(true) {
+      unsigned w = word.load(std::memory_order_relaxed);
+      if((w & ~(unsigned)PENDING) == 0) {
+	if(word.compare_exchange_weak(w, WRITER, std::memory_order_acquire)) return;
+      }
+      else if(!(w & PENDING)) {
+	word.fetch_or(PENDING, std::memory_order_relaxed);
+      }
+      backoff(spins);
+    }
+  }
+
+  void unlock()
+  {
+    word.fetch_and(~(unsigned)WRITER, std::memory_order_release);
+  }
+
+  /**
+   * The word can serve as a version counter instead, for
+   * readers that take no lock at all: it is odd while the one
+   * writer changes what it guards, and moves on by two per
+   * change. Writers have to be serialized by the caller.
+   */
+  void begin_change()
+  {
+    word.store(word.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void end_change()
+  {
+    word.store(word.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /**
+   * RETURNS the version, once no change is in progress.
+   */
+  unsigned stable_version()
+  {
+    int spins = 0;
+    unsigned w;
+    while((w = word.load(std::memory_order_acquire)) & WRITER) {
+      backoff(spins);
+    }
+    return w;
+  }
+
+  /**
+   * RETURNS whether nothing changed since stable_version
+   * returned version, including what was loaded in between.
+   */
+  bool validate(unsigned version)
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return word.load(std::memory_order_relaxed) == version;
+  }
+};
+
+/**
+ * Common interface of the locks that can guard a whole tree,
+ * so they can be swapped without touching the callers.
+ */
+class rw_lock {
+public:
+  virtual ~rw_lock() {}
+  virtual void begin_read(int reader) = 0;
+  virtual void end_read(int reader) = 0;
+  virtual void begin_write(int writer) = 0;
+  virtual void end_write(int writer) = 0;
+};
+
+// enum representing which side a rw_monitor favors when both are waiting
+enum rw_policy { prefer_readers, prefer_writers, fair };
+
+/**
+ * Monitor class for the readers-writers problem
+ * that is used to implement concurrency in this project.
+ * It includes standard variables and methods associated with
+ * a readers-writers problem. The policy decides who goes first:
+ * readers (best read throughput, writers can starve), writers
+ * (bounded writer latency, readers can starve), or fair, where
+ * everyone is served in ticket order and consecutive readers
+ * share the tree.
+ */
+class rw_monitor : public rw_lock {
+private:
+  rw_policy policy;
+  int num_readers;
+  int num_writers;
+  int readers_wait;
+  int writers_wait;
+  unsigned long next_ticket;
+  unsigned long now_serving;
+
+  pthread_cond_t can_read;
+  pthread_cond_t can_write;
+  pthread_cond_t turn;
+  pthread_mutex_t cond_lock;
+
+  /**
+   * RETURNS true if a new reader has to wait.
+   */
+  bool reader_blocked()
+  {
+    if(policy == prefer_writers) return num_writers == 1 || writers_wait > 0;
+    return num_writers == 1;
+  }
+
+public:
+  rw_monitor(rw_policy policy = prefer_readers)
+  {
+    this->policy = policy;
+    num_readers = 0;
+    num_writers = 0;
+    readers_wait = 0;
+    writers_wait = 0;
+    next_ticket = 0;
+    now_serving = 0;
+
+    pthread_cond_init(&can_read, NULL); 
+    pthread_cond_init(&can_write, NULL); 
+    pthread_cond_init(&turn, NULL);
+    pthread_mutex_init(&cond_lock, NULL);
+  }
+
+  /**
+   * Changes the policy; only safe while no
+   * thread is using the monitor.
+   */
+  void set_policy(rw_policy policy) { this->policy = policy; }
+  rw_policy get_policy() { return policy; }
+
+  /**
+   * This function begins the reading of 
+   * tree data once the policy lets it in.
+   * There can be multiple readers.
+   */
+  void begin_read(int reader)
+  {
+    RB_LOCK_ASKED(asked);
+    pthread_mutex_lock(&cond_lock);
+
+    if (policy == fair) {
+      unsigned long ticket = next_ticket++;
+      while (ticket != now_serving || num_writers == 1) {
+	RB_LOCK_SLEPT(read_side);
+	pthread_cond_wait(&turn, &cond_lock);
+      }
+      now_serving++;
+      num_readers++;
+      // the next ticket may be a reader that can join this phase
+      pthread_cond_broadcast(&turn);
+      pthread_mutex_unlock(&cond_lock);
+      RB_LOCK_ACQUIRED(read_side, asked);
+      return;
+    }
+
+    readers_wait++;
+    while (reader_blocked()) {
+      RB_LOCK_SLEPT(read_side);
+      pthread_cond_wait(&can_read, &cond_lock);
+    }
+    readers_wait--;
+    num_readers++;
+    pthread_mutex_unlock(&cond_lock); 
+    RB_LOCK_ACQUIRED(read_side, asked);
+  }
+
+  /**
+   * This function ends a reader and checks if 
+   * there are any left. If there are none left, 
+   * then any waiting writers can begin inserting/deleting.
+   */
+  void end_read(int reader)
+  {
+    RB_LOCK_RELEASED(read_side);
+    pthread_mutex_lock(&cond_lock); 
+    
+    if (--num_readers == 0) { 
+      if (policy == fair) pthread_cond_broadcast(&turn);
+      else pthread_cond_signal(&can_write);
+    }
+    
+    pthread_mutex_unlock(&cond_lock); 
+  }
+
+  /**
+   * This function begins the inserting/deleting of
+   * the global red-black tree once there are no readers
+   * or writers left in it and the policy lets it in.
+   */
+  void begin_write(int writer)
+  {
+    RB_LOCK_ASKED(asked);
+    pthread_mutex_lock(&cond_lock); 
+
+    if (policy == fair) {
+      unsigned long ticket = next_ticket++;
+      while (ticket != now_serving || num_writers == 1 || num_readers > 0) {
+	RB_LOCK_SLEPT(write_side);
+	pthread_cond_wait(&turn, &cond_lock);
+      }
+      now_serving++;
+      num_writers = 1;
+      pthread_mutex_unlock(&cond_lock);
+      RB_LOCK_ACQUIRED(write_side, asked);
+      return;
+    }
+
+    writers_wait++; 
+    while (num_writers == 1 || num_readers > 0 ||
+	   (policy == prefer_readers && readers_wait > 0)) {
+      RB_LOCK_SLEPT(write_side);
+      pthread_cond_wait(&can_write, &cond_lock); 
+    }
+    writers_wait--; 
+    num_writers = 1;
+    pthread_mutex_unlock(&cond_lock); 
+    RB_LOCK_ACQUIRED(write_side, asked);
+  }
+
+  /**
+   * This function ends a writer and wakes up
+   * whoever the policy says goes next.
+   */
+  void end_write(int writer)
+  {
+    RB_LOCK_RELEASED(write_side);
+    pthread_mutex_lock(&cond_lock); 
+    num_writers = 0; 
+
+    if (policy == fair) {
+      pthread_cond_broadcast(&turn);
+    }
+    else if (policy == prefer_readers) {
+      if (readers_wait > 0) pthread_cond_broadcast(&can_read);
+      else pthread_cond_signal(&can_write);
+    }
+    else {
+      if (writers_wait > 0) pthread_cond_signal(&can_write);
+      else pthread_cond_broadcast(&can_read);
+    }
+    pthread_mutex_unlock(&cond_lock);
+  }
+};
+
+/**
+ * A reader-writer lock kept in one atomic word. An uncontended
+ * read is a single compare-and-swap to enter and a single
+ * decrement to leave. Threads that cannot get in spin briefly
+ * and then sleep on the word with a futex, so long waits don't
+ * burn a core. A waiting writer blocks new readers.
+ */
+class futex_rwlock : public rw_lock {
+private:
+  enum { WRITER = 1, PENDING = 2, SLEEPERS = 4, READER = 8 };
+  std::atomic<unsigned> word;
+
+  /**
+   * Sleeps until the word changes from seen, after
+   * flagging that someone needs to be woken up.
+   */
+  void sleep(unsigned seen)
+  {
+    word.fetch_or(SLEEPERS, std::memory_order_relaxed);
+    syscall(SYS_futex, (unsigned*) &word, FUTEX_WAIT_PRIVATE,
+	    seen | SLEEPERS, NULL, NULL, 0);
+  }
+
+  /**
+   * Wakes every sleeper if old says there were any.
+   */
+  void wake(unsigned old)
+  {
+    if(old & SLEEPERS) {
+      word.fetch_and(~(unsigned)SLEEPERS, std::memory_order_relaxed);
+      syscall(SYS_futex, (unsigned*) &word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+  }
+
+public:
+  futex_rwlock() : word(0) {}
+
+  void begin_read(int reader)
+  {
+    RB_LOCK_ASKED(asked);
+    for(int spins = 0; ; spins++) {
+      unsigned w = word.load(std::memory_order_relaxed);
+      if(!(w & (WRITER | PENDING))) {
+	if(word.compare_exchange_weak(w, w + READER, std::memory_order_acquire)) {
+	  RB_LOCK_ACQUIRED(read_side, asked);
+	  return;
+	}
+      }
+      else if(spins > 100) {
+	RB_LOCK_SLEPT(read_side);
+	sleep(w);
+      }
+    }
+  }
+
+  void end_read(int reader)
+  {
+    RB_LOCK_RELEASED(read_side);
+    unsigned old = word.fetch_sub(READER, std::memory_order_release);
+    if((old & ~(unsigned)(PENDING | SLEEPERS)) == READER) wake(old);
+  }
+
+  void begin_write(int writer)
+  {
+    RB_LOCK_ASKED(asked);
+    for(int spins = 0; ; spins++) {
+      unsigned w = word.load(std::memory_order_relaxed);
+      if((w & ~(unsigned)(PENDING | SLEEPERS)) == 0) {
+	if(word.compare_exchange_weak(w, WRITER | (w & SLEEPERS), std::memory_order_acquire)) {
+	  RB_LOCK_ACQUIRED(write_side, asked);
+	  return;
+	}
+      }
+      else if(!(w & PENDING)) {
+	word.fetch_or(PENDING, std::memory_order_relaxed);
+      }
+      else if(spins > 100) {
+	RB_LOCK_SLEPT(write_side);
+	sleep(w);
+      }
+    }
+  }
+
+  void end_write(int writer)
+  {
+    RB_LOCK_RELEASED(write_side);
+    wake(word.fetch_and(~(unsigned)WRITER, std::memory_order_release));
+  }
+};
+
+/**
+ * A distributed reader-writer lock: every reader thread owns
+ * a cache-line sized counter, so readers never write to a line
+ * another core is using. A writer raises a single flag and then
+ * waits for every reader counter to drain, which makes writes
+ * cost O(threads) in exchange for reads that don't bounce.
+ */
+class dist_rwlock : public rw_lock {
+private:
+  struct alignas(64) slot {
+    std::atomic<int> active;
+  };
+
+  slot slots[MAX_READERS];
+  std::atomic<int> writer;
+  pthread_mutex_t writer_lock;
+
+public:
+  dist_rwlock() : writer(0)
+  {
+    for(int i = 0; i < MAX_READERS; i++) {
+      slots[i].active.store(0);
+    }
+    pthread_mutex_init(&writer_lock, NULL);
+  }
+
+  void begin_read(int reader)
+  {
+    RB_LOCK_ASKED(asked);
+    slot& s = slots[reader_id::self()];
+    while(true) {
+      s.active.store(1, std::memory_order_seq_cst);
+      if(writer.load(std::memory_order_seq_cst) == 0) {
+	RB_LOCK_ACQUIRED(read_side, asked);
+	return;
+      }
+
+      // back off so the writer can drain, then try again
+      s.active.store(0, std::memory_order_release);
+      while(writer.load(std::memory_order_relaxed) != 0) {
+	RB_LOCK_SLEPT(read_side);
+	syscall(SYS_futex, (int*) &writer, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+      }
+    }
+  }
+
+  void end_read(int reader)
+  {
+    RB_LOCK_RELEASED(read_side);
+    slots[reader_id::self()].active.store(0, std::memory_order_release);
+  }
+
+  void begin_write(int w)
+  {
+    RB_LOCK_ASKED(asked);
+    pthread_mutex_lock(&writer_lock);
+    writer.store(1, std::memory_order_seq_cst);
+
+    int readers = reader_id::high_water.load();
+    for(int i = 0; i < readers; i++) {
+      while(slots[i].active.load(std::memory_order_acquire) != 0) {
+	RB_LOCK_SLEPT(write_side);
+	sched_yield();
+      }
+    }
+    RB_LOCK_ACQUIRED(write_side, asked);
+  }
+
+  void end_write(int w)
+  {
+    RB_LOCK_RELEASED(write_side);
+    writer.store(0, std::memory_order_release);
+    syscall(SYS_futex, (int*) &writer, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    pthread_mutex_unlock(&writer_lock);
+  }
+};
+
+/**
+ * Creates the whole-tree lock named by kind: "monitor" (with
+ * the given policy), "futex" or "distributed".
+ * RETURNS the new lock, NULL if kind is unknown.
+ */
+inline rw_lock* make_rw_lock(std::string kind, rw_policy policy = prefer_readers)
+{
+  if(kind == "monitor") return new rw_monitor(policy);
+  if(kind == "futex") return new futex_rwlock();
+  if(kind == "distributed") return new dist_rwlock();
+  return NULL;
+}
+
+#endif
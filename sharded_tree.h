@@ -0,0 +1,287 @@
+#ifndef _SHARDED_TREE_H
+ # define _SHARDED_TREE_H
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
+#include "rw_lock.h"
+#include "rbtree.h"
+#include "numa_placement.h"
+
+/**
+ * A set of independent red-black trees that split the keys
+ * between them, so writers to different shards never wait on
+ * each other. Keys are either hashed to a shard or, given
+ * split keys, assigned by range: shard i holds the keys from
+ * splits[i - 1] up to, but not including, splits[i]. Every shard
+ * has its own arena and its own locks; in global mode each one is
+ * guarded by its own whole-tree lock, which the container takes
+ * itself, so unlike RBTree it needs no lock from the caller.
+ */
+template <class Key, class Value = rb_empty, class Compare = std::less<Key>,
+	  template <class> class Alloc = node_arena>
+class sharded_rbtree {
+public:
+  typedef RBTree<Key, Value, Compare, Alloc> tree;
+  typedef typename tree::node_p node_p;
+
+  sharded_rbtree(int count, lock_mode mode = global_lock, std::string lock_kind = "monitor");
+  sharded_rbtree(const std::vector<Key>& splits, lock_mode mode = global_lock,
+		 std::string lock_kind = "monitor");
+  ~sharded_rbtree();
+
+  void build_sorted(const std::vector<Key>& keys);
+  void insert_node(const Key& key, const Value& value = Value());
+  void delete_node(const Key& key);
+  bool erase(const Key& key);
+  node_p search_tree(const Key& key);
+  bool lookup(const Key& key, Value& value);
+  template <class F> size_t range_scan(const Key& lo, const Key& hi, F callback);
+  int shard_of(const Key& key);
+  int size() { return shards.size(); }
+  tree& shard(int i) { return *shards[i]; }
+  void spread_over_nodes();
+  int node_of(int i) { return shards[i]->get_numa_node(); }
+private:
+  std::vector<tree*> shards;
+  std::vector<rw_lock*> locks;   // one per shard, only used in global mode
+  std::vector<Key> splits;       // empty when the keys are hashed
+  lock_mode mode;
+  Compare compare;
+
+  void create(int count, lock_mode mode, std::string lock_kind);
+  void begin_read(int i) { if(mode == global_lock) locks[i]->begin_read(0); }
+  void end_read(int i) { if(mode == global_lock) locks[i]->end_read(0); }
+  void begin_write(int i) { if(mode == global_lock) locks[i]->begin_write(0); }
+  void end_write(int i) { if(mode == global_lock) locks[i]->end_write(0); }
+
+  sharded_rbtree(const sharded_rbtree&);
+  sharded_rbtree& operator=(const sharded_rbtree&);
+};
+
+// out-of-class definitions of the container's members
+#define SHARD_TEMPLATE template <class Key, class Value, class Compare, template <class> class Alloc>
+#define SHARDED_TREE sharded_rbtree<Key, Value, Compare, Alloc>
+
+/**
+ * Creates count shards that keys are hashed to.
+ */
+SHARD_TEMPLATE
+SHARDED_TREE::sharded_rbtree(int count, lock_mode mode, std::string lock_kind)
+{
+  create(count < 1 ? 1 : count, mode, lock_kind);
+}
+
+/**
+ * Creates one shard more than there are split keys, which
+ * have to be sorted; keys are assigned to shards by range.
+ */
+SHARD_TEMPLATE
+SHARDED_TREE::sharded_rbtree(const std::vector<Key>& splits, lock_mode mode, std::string lock_kind)
+{
+  this->splits = splits;
+  create(splits.size() + 1, mode, lock_kind);
+}
+
+/**
+ * Helper function that sets up the shards and,
+ * in global mode, their locks. A mode the node layout
+ * does not support falls back to the global one.
+ */
+SHARD_TEMPLATE
+void SHARDED_TREE::create(int count, lock_mode mode, std::string lock_kind)
+{
+  if(!tree::supports(mode)) mode = global_lock;
+  this->mode = mode;
+  for(int i = 0; i < count; i++) {
+    shards.push_back(new tree());
+    shards.back()->set_lock_mode(mode);
+    locks.push_back(mode == global_lock ? make_rw_lock(lock_kind) : NULL);
+  }
+}
+
+SHARD_TEMPLATE
+SHARDED_TREE::~sharded_rbtree()
+{
+  for(unsigned i = 0; i < shards.size(); i++) {
+    delete shards[i];
+    delete locks[i];
+  }
+}
+
+/**
+ * Deals the shards out over the NUMA nodes, shard i to node i
+ * modulo their number, so each node holds its share of the keys.
+ * Threads that work on a shard do best on a CPU of node_of(i),
+ * the kernel's id of that node, where its nodes and its lock's
+ * cache line stay local.
+ */
+SHARD_TEMPLATE
+void SHARDED_TREE::spread_over_nodes()
+{
+  const numa_topology& topology = numa_topology::get();
+  for(unsigned i = 0; i < shards.size(); i++) {
+    shards[i]->set_numa_node(topology.node_id(i % topology.nodes()));
+  }
+}
+
+/**
+ * Builds every shard from its part of a list of keys that
+ * is sorted and has no duplicates, see RBTree::build_sorted.
+ */
+SHARD_TEMPLATE
+void SHARDED_TREE::build_sorted(const std::vector<Key>& keys)
+{
+  std::vector<std::vector<Key> > parts(shards.size());
+  for(unsigned i = 0; i < keys.size(); i++) {
+    parts[shard_of(keys[i])].push_back(keys[i]);
+  }
+  for(unsigned i = 0; i < shards.size(); i++) {
+    shards[i]->build_sorted(parts[i]);
+  }
+}
+
+/**
+ * RETURNS the shard that holds key. Hashed keys are mixed
+ * first, so keys that are close together still spread out.
+ */
+SHARD_TEMPLATE
+int SHARDED_TREE::shard_of(const Key& key)
+{
+  if(!splits.empty()) {
+    return std::upper_bound(splits.begin(), splits.end(), key, compare) - splits.begin();
+  }
+  size_t h = std::hash<Key>()(key) * 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) % shards.size();
+}
+
+/**
+ * Inserts the entry into the shard that owns its key.
+ */
+SHARD_TEMPLATE
+void SHARDED_TREE::insert_node(const Key& key, const Value& value)
+{
+  int i = shard_of(key);
+  begin_write(i);
+  shards[i]->insert_node(key, value);
+  end_write(i);
+}
+
+/**
+ * Deletes key from the shard that owns it,
+ * complaining like RBTree if it is not there.
+ */
+SHARD_TEMPLATE
+void SHARDED_TREE::delete_node(const Key& key)
+{
+  int i = shard_of(key);
+  begin_write(i);
+  shards[i]->delete_node(key);
+  end_write(i);
+}
+
+/**
+ * Deletes key if it is there.
+ * RETURNS whether it was.
+ */
+SHARD_TEMPLATE
+bool SHARDED_TREE::erase(const Key& key)
+{
+  int i = shard_of(key);
+  begin_write(i);
+  bool erased = shards[i]->erase(key);
+  end_write(i);
+  return erased;
+}
+
+/**
+ * Searches the shard that owns key. In global mode the node
+ * may be gone as soon as the shard's lock is dropped, so the
+ * result is only good for comparing against NULL; use lookup
+ * to get at the value.
+ * RETURNS the found node, NULL otherwise.
+ */
+SHARD_TEMPLATE
+typename SHARDED_TREE::node_p SHARDED_TREE::search_tree(const Key& key)
+{
+  int i = shard_of(key);
+  begin_read(i);
+  node_p n = shards[i]->search_tree(key);
+  end_read(i);
+  return n;
+}
+
+/**
+ * Copies the value mapped to key into value.
+ * RETURNS whether key is in the tree.
+ */
+SHARD_TEMPLATE
+bool SHARDED_TREE::lookup(const Key& key, Value& value)
+{
+  int i = shard_of(key);
+  begin_read(i);
+  bool found = shards[i]->lookup(key, value);
+  end_read(i);
+  return found;
+}
+
+/**
+ * Calls callback(key, value) for every entry with a key in
+ * [lo, hi], in key order. Each shard is scanned under its own
+ * read acquisition, so a scan is consistent per shard but not
+ * across them. Range shards are scanned one after another;
+ * hashed shards each yield a sorted run, and the runs are merged.
+ * RETURNS the number of entries visited.
+ */
+SHARD_TEMPLATE
+template <class F>
+size_t SHARDED_TREE::range_scan(const Key& lo, const Key& hi, F callback)
+{
+  size_t visited = 0;
+
+  if(!splits.empty()) {
+    int last = shard_of(hi);
+    for(int i = shard_of(lo); i <= last; i++) {
+      begin_read(i);
+      visited += shards[i]->range_scan(lo, hi, callback);
+      end_read(i);
+    }
+    return visited;
+  }
+
+  typedef std::pair<Key, Value> entry;
+  std::vector<std::vector<entry> > runs(shards.size());
+  for(unsigned i = 0; i < shards.size(); i++) {
+    begin_read(i);
+    shards[i]->range_scan(lo, hi, [&](const Key& key, const Value& value) {
+      runs[i].push_back(entry(key, value));
+    });
+    end_read(i);
+  }
+
+  // the head of every run, smallest key on top
+  typedef std::pair<unsigned, unsigned> head;
+  Compare less = compare;
+  auto later = [&](const head& a, const head& b) {
+    return less(runs[b.first][b.second].first, runs[a.first][a.second].first);
+  };
+  std::priority_queue<head, std::vector<head>, decltype(later)> heads(later);
+  for(unsigned i = 0; i < runs.size(); i++) {
+    if(!runs[i].empty()) heads.push(head(i, 0));
+  }
+
+  while(!heads.empty()) {
+    head h = heads.top();
+    heads.pop();
+    callback(runs[h.first][h.second].first, runs[h.first][h.second].second);
+    visited++;
+    if(h.second + 1 < runs[h.first].size()) heads.push(head(h.first, h.second + 1));
+  }
+  return visited;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef _THREAD_POOL_H
+ # define _THREAD_POOL_H
+
+#include <pthread.h>
+#include <queue>
+#include <vector>
+
+#include "numa_placement.h"
+
+/**
+ * A fixed-size pool of long-lived worker threads
+ * that pull jobs off of a shared queue. Jobs have the
+ * same signature as a pthread start routine so the
+ * existing thread functions can be submitted unchanged.
+ * Given a list of CPUs, worker i stays on cpus[i] modulo
+ * the list's length instead of floating between cores.
+ */
+class thread_pool {
+public:
+  typedef void* (*job_fn)(void*);
+
+  thread_pool(int num_workers, const std::vector<int>& cpus = std::vector<int>());
+  ~thread_pool();
+
+  void submit(job_fn fn, void* arg);
+  void wait_idle();
+  int size() { return workers.size(); }
+private:
+  struct job {
+    job_fn fn;
+    void* arg;
+  };
+
+  std::vector<pthread_t> workers;
+  std::queue<job> jobs;
+  int active;
+  bool stopping;
+
+  pthread_mutex_t lock;
+  pthread_cond_t has_job;
+  pthread_cond_t idle;
+
+  static void* worker_loop(void* pool);
+};
+
+/**
+ * Starts num_workers threads up front, pinned to cpus
+ * unless it is empty; a pool always has at least one worker.
+ */
+inline thread_pool::thread_pool(int num_workers, const std::vector<int>& cpus)
+{
+  active = 0;
+  stopping = false;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&has_job, NULL);
+  pthread_cond_init(&idle, NULL);
+
+  if(num_workers < 1) num_workers = 1;
+  for(int i = 0; i < num_workers; i++) {
+    pthread_t t;
+    if(pthread_create(&t, NULL, worker_loop, this)) break;
+    if(!cpus.empty()) pin_thread(t, cpus[i % cpus.size()]);
+    workers.push_back(t);
+  }
+}
+
+/**
+ * Lets the workers drain whatever is still queued
+ * and then joins all of them.
+ */
+inline thread_pool::~thread_pool()
+{
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&has_job);
+  pthread_mutex_unlock(&lock);
+
+  for(unsigned i = 0; i < workers.size(); i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&idle);
+  pthread_cond_destroy(&has_job);
+  pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Queues fn(arg) to be run by the next free worker.
+ */
+inline void thread_pool::submit(job_fn fn, void* arg)
+{
+  job j = { fn, arg };
+
+  pthread_mutex_lock(&lock);
+  jobs.push(j);
+  pthread_cond_signal(&has_job);
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Blocks until the queue is empty and
+ * no worker is running a job.
+ */
+inline void thread_pool::wait_idle()
+{
+  pthread_mutex_lock(&lock);
+  while(!jobs.empty() || active > 0) {
+    pthread_cond_wait(&idle, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Body of every worker thread: repeatedly takes
+ * the job at the front of the queue and runs it.
+ */
+inline void* thread_pool::worker_loop(void* pool)
+{
+  thread_pool* p = (thread_pool*) pool;
+
+  pthread_mutex_lock(&p->lock);
+  while(true) {
+    while(p->jobs.empty() && !p->stopping) {
+      pthread_cond_wait(&p->has_job, &p->lock);
+    }
+    if(p->jobs.empty()) break;
+
+    job j = p->jobs.front();
+    p->jobs.pop();
+    p->active++;
+    pthread_mutex_unlock(&p->lock);
+
+    j.fn(j.arg);
+
+    pthread_mutex_lock(&p->lock);
+    p->active--;
+    if(p->jobs.empty() && p->active == 0) {
+      pthread_cond_broadcast(&p->idle);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+#endif
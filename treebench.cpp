@@ -0,0 +1,511 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "rw_lock.h"
+#include "rbtree.h"
+#include "rb_stats.h"
+#include "sharded_tree.h"
+#include "flat_combining.h"
+#include "btree.h"
+#include "numa_placement.h"
+
+using namespace std;
+
+typedef RBTree<int> bench_tree;
+typedef sharded_rbtree<int> bench_shards;
+typedef write_combiner<bench_tree> bench_combiner;
+typedef BPlusTree<int> bench_btree;
+
+enum key_dist { uniform_keys, zipf_keys, sequential_keys };
+const char* dist_names[] = { "uniform", "zipf", "sequential" };
+const char* mode_names[] = { "global", "coupling", "rcu", "optimistic" };
+
+/**
+ * Everything that describes one workload.
+ */
+struct workload {
+  int threads;
+  long size;        // keys in the tree before the run
+  long range;       // keys are drawn from [0, range)
+  key_dist dist;
+  double theta;     // skew of the Zipfian distribution
+  int search_percent;
+  int insert_percent;
+  double seconds;
+  string rwlock;    // whole-tree lock used in global mode
+  int shards;       // 0 for a single tree
+  bool by_range;    // split the key range between the shards instead of hashing
+  bool combine;     // send the single tree's writes through a combiner
+  bool freeze;      // freeze the single tree before the run
+  bool pin;         // pin the threads, and keep each on its own node's shards
+};
+
+/**
+ * Draws Zipf-distributed ranks in [0, n) with the method of
+ * Gray et al., "Quickly Generating Billion-Record Synthetic
+ * Databases"; the constants only depend on n and theta, so one
+ * generator is shared by every thread.
+ */
+struct zipf_gen {
+  long n;
+  double theta, alpha, zetan, eta;
+
+  zipf_gen(long n, double theta) : n(n), theta(theta)
+  {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    zetan = 0;
+    for(long i = 1; i <= n; i++) zetan += 1.0 / pow((double) i, theta);
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+  }
+
+  /**
+   * RETURNS the rank for the uniform draw u in [0, 1).
+   */
+  long rank(double u) const
+  {
+    double uz = u * zetan;
+    if(uz < 1.0) return 0;
+    if(uz < 1.0 + pow(0.5, theta)) return 1;
+    long r = (long) (n * pow(eta * u - eta + 1.0, alpha));
+    return r < n ? r : n - 1;
+  }
+};
+
+/**
+ * Everything a benchmark thread needs. Each one lives
+ * on its own cache line so the counters don't interfere
+ * with the tree being measured.
+ */
+struct alignas(64) bench_thread {
+  bench_tree* tree;
+  bench_shards* sharded;   // used instead of tree if not NULL
+  bench_combiner* combiner; // likewise
+  bench_btree* btree;      // likewise, always under lock
+  rw_lock* lock;
+  const workload* w;
+  const zipf_gen* zipf;
+  int tid;
+  int home;        // kernel id of the NUMA node whose shards it sticks to, -1 for any shard
+  atomic<bool>* stop;
+  uint64_t seed;
+  long cursor;
+  long ops[3];
+  latency_histogram latency;
+};
+
+/**
+ * xorshift64*; plenty for picking keys and is
+ * much cheaper than rand_r.
+ */
+static inline uint64_t next_random(uint64_t& s)
+{
+  s ^= s >> 12;
+  s ^= s << 25;
+  s ^= s >> 27;
+  return s * 2685821657736338717ULL;
+}
+
+/**
+ * RETURNS the next key from the workload's distribution.
+ */
+static inline int draw_key(bench_thread* t)
+{
+  const workload* w = t->w;
+
+  if(w->dist == sequential_keys) {
+    long k = t->cursor;
+    t->cursor += w->threads;
+    if(t->cursor >= w->range) t->cursor -= w->range;
+    return k;
+  }
+  uint64_t r = next_random(t->seed);
+  if(w->dist == uniform_keys) return r % w->range;
+
+  // scatter the hot ranks over the whole key range
+  long rank = t->zipf->rank((r >> 11) * 0x1.0p-53);
+  return (rank * 2654435761UL) % w->range;
+}
+
+/**
+ * Draws keys until one falls in a shard on the thread's home
+ * node, which keeps the distribution within those shards.
+ * RETURNS the key of the thread's next operation.
+ */
+static inline int next_key(bench_thread* t)
+{
+  int key = draw_key(t);
+  if(t->home >= 0) {
+    while(t->sharded->node_of(t->sharded->shard_of(key)) != t->home) key = draw_key(t);
+  }
+  return key;
+}
+
+/**
+ * Runs the workload's mix of operations against tree until
+ * told to stop, timing every one. If lock is not NULL every
+ * operation holds it, as in the tree's global mode.
+ * RETURNS how many searches found their key.
+ */
+template <class Tree>
+long run_ops(bench_thread* t, Tree* tree, rw_lock* lock)
+{
+  const workload* w = t->w;
+  long found = 0;
+
+  while(!t->stop->load(memory_order_relaxed)) {
+    int key = next_key(t);
+    int dice = next_random(t->seed) % 100;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    if(dice < w->search_percent) {
+      if(lock) lock->begin_read(t->tid);
+      found += tree->search_tree(key) != NULL;
+      if(lock) lock->end_read(t->tid);
+      t->ops[0]++;
+    }
+    else if(dice < w->search_percent + w->insert_percent) {
+      if(lock) lock->begin_write(t->tid);
+      tree->insert_node(key);
+      if(lock) lock->end_write(t->tid);
+      t->ops[1]++;
+    }
+    else {
+      if(lock) lock->begin_write(t->tid);
+      tree->erase(key);
+      if(lock) lock->end_write(t->tid);
+      t->ops[2]++;
+    }
+
+    t->latency.add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+  }
+  return found;
+}
+
+/**
+ * Thread function that runs the workload against the shards
+ * or the combiner, which lock themselves, the B+-tree, which
+ * always needs the whole-tree lock, or the single tree.
+ */
+void* bench_loop(void* arg)
+{
+  bench_thread* t = (bench_thread*) arg;
+
+  if(t->sharded != NULL) {
+    return (void*) run_ops(t, t->sharded, NULL);
+  }
+  if(t->combiner != NULL) {
+    return (void*) run_ops(t, t->combiner, NULL);
+  }
+  if(t->btree != NULL) {
+    return (void*) run_ops(t, t->btree, t->lock);
+  }
+  bool global = t->tree->get_lock_mode() == global_lock;
+  return (void*) run_ops(t, t->tree, global ? t->lock : NULL);
+}
+
+/**
+ * Fills a fresh tree with the workload's keys, runs the
+ * workload against it in the given mode for the given number
+ * of seconds and prints the throughput and latencies. With
+ * btree the tree is a B+-tree under the whole-tree lock
+ * instead, and mode is ignored.
+ */
+void run(lock_mode mode, const workload& w, const zipf_gen* zipf, bool btree)
+{
+  bench_tree tree;
+  bench_shards* sharded = NULL;
+  bench_combiner* combiner = NULL;
+  bench_btree* bplus = NULL;
+  rw_lock* lock = make_rw_lock(w.rwlock);
+
+  // every (range / size)-th key, so the tree starts with the right density
+  vector<int> keys;
+  keys.reserve(w.size);
+  for(long i = 0; i < w.size; i++) keys.push_back(i * w.range / w.size);
+
+  if(btree) {
+    bplus = new bench_btree();
+  }
+  else if(w.shards > 0 && w.by_range) {
+    vector<int> splits;
+    for(int i = 1; i < w.shards; i++) splits.push_back(i * w.range / w.shards);
+    sharded = new bench_shards(splits, mode, w.rwlock);
+  }
+  else if(w.shards > 0) {
+    sharded = new bench_shards(w.shards, mode, w.rwlock);
+  }
+
+  if(bplus != NULL) {
+    bplus->build_sorted(keys);
+  }
+  else if(sharded != NULL) {
+    if(w.pin) sharded->spread_over_nodes();
+    sharded->build_sorted(keys);
+  }
+  else {
+    tree.build_sorted(keys);
+    tree.set_lock_mode(mode);
+    if(w.freeze) tree.freeze();
+    if(w.combine) combiner = new bench_combiner(&tree, mode == global_lock ? lock : NULL);
+  }
+
+  vector<bench_thread> data(w.threads);
+  vector<pthread_t> ids(w.threads);
+  atomic<bool> stop(false);
+  const numa_topology& topology = numa_topology::get();
+  vector<int> cpus = topology.spread();
+
+  for(int i = 0; i < w.threads; i++) {
+    data[i].tree = &tree;
+    data[i].sharded = sharded;
+    data[i].combiner = combiner;
+    data[i].btree = bplus;
+    data[i].lock = lock;
+    data[i].w = &w;
+    data[i].zipf = zipf;
+    data[i].tid = i;
+    data[i].home = -1;
+    // a node without shards of its own lets its threads go anywhere
+    if(w.pin && sharded != NULL) {
+      int node = topology.node_of_cpu(cpus[i % cpus.size()]);
+      if(node < sharded->size()) data[i].home = topology.node_id(node);
+    }
+    data[i].stop = &stop;
+    data[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    data[i].cursor = i % w.range;
+    data[i].ops[0] = data[i].ops[1] = data[i].ops[2] = 0;
+  }
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for(int i = 0; i < w.threads; i++) {
+    pthread_create(&ids[i], NULL, bench_loop, &data[i]);
+    if(w.pin) pin_thread(ids[i], cpus[i % cpus.size()]);
+  }
+
+  struct timespec ts;
+  ts.tv_sec = (time_t) w.seconds;
+  ts.tv_nsec = (long) ((w.seconds - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+  stop.store(true);
+
+  long ops[3] = { 0, 0, 0 };
+  latency_histogram latency;
+  for(int i = 0; i < w.threads; i++) {
+    pthread_join(ids[i], NULL);
+    for(int k = 0; k < 3; k++) ops[k] += data[i].ops[k];
+    latency.merge(data[i].latency);
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << left << setw(10) << (btree ? "btree" : mode_names[mode]) << right << fixed << setprecision(2)
+       << setw(10) << (ops[0] + ops[1] + ops[2]) / elapsed / 1e6
+       << setw(10) << ops[0] / elapsed / 1e6
+       << setw(10) << ops[1] / elapsed / 1e6
+       << setw(10) << ops[2] / elapsed / 1e6
+       << setw(9) << latency.percentile(50)
+       << setw(9) << latency.percentile(90)
+       << setw(9) << latency.percentile(99)
+       << setw(9) << latency.percentile(99.9) << endl;
+  delete sharded;
+  delete combiner;
+  delete bplus;
+  delete lock;
+}
+
+/**
+ * Prints the command-line usage of the benchmark.
+ */
+void usage(const char* name)
+{
+  cout << "Usage: " << name << " [-t|--threads=n] [-n|--size=keys] [-k|--range=keys]\n"
+       << "       [-d|--dist=uniform|zipf|sequential] [-z|--theta=skew]\n"
+       << "       [-x|--mix=search/insert/delete] [-s|--seconds=s]\n"
+       << "       [-l|--lock=global|coupling|rcu|optimistic] [-r|--rwlock=monitor|futex|distributed]\n"
+       << "       [-S|--shards=n] [-R|--range-shards] [-c|--combine]\n"
+       << "       [-e|--engine=rbtree|btree|all] [-f|--freeze] [-P|--pin]" << endl;
+  cout << "  -t, --threads  worker threads (default 4)" << endl;
+  cout << "  -n, --size     keys in the tree before each run (default 100000)" << endl;
+  cout << "  -k, --range    keys are drawn from [0, range) (default twice the size)" << endl;
+  cout << "  -d, --dist     how keys are picked (default uniform); sequential walks" << endl;
+  cout << "                 the range in order, each thread on its own stride" << endl;
+  cout << "  -z, --theta    skew of the zipf distribution, in (0, 1) (default 0.99)" << endl;
+  cout << "  -x, --mix      percentages of searches, inserts and deletes (default 90/5/5)" << endl;
+  cout << "  -s, --seconds  length of each run (default 1)" << endl;
+  cout << "  -l, --lock     only run this locking mode (default all of them)" << endl;
+  cout << "  -r, --rwlock   whole-tree lock used in global mode (default monitor)" << endl;
+  cout << "  -S, --shards   hash the keys over n independent trees, each with its own" << endl;
+  cout << "                 lock and arena (default one tree)" << endl;
+  cout << "  -R, --range-shards  give every shard an equal part of the key range" << endl;
+  cout << "                 instead of hashing" << endl;
+  cout << "  -c, --combine  let one writer at a time apply everyone's pending inserts" << endl;
+  cout << "                 and deletes (flat combining); ignored with shards" << endl;
+  cout << "  -e, --engine   rbtree runs the red-black tree in every locking mode" << endl;
+  cout << "                 (default), btree a B+-tree whose nodes keep their keys and" << endl;
+  cout << "                 count in one cache line, under the whole-tree lock, all both" << endl;
+  cout << "                 of them" << endl;
+  cout << "  -f, --freeze   search a frozen copy of the red-black tree until the first" << endl;
+  cout << "                 write; only helps with a mix without writes" << endl;
+  cout << "  -P, --pin      pin every thread to a core, taking the cores of each socket" << endl;
+  cout << "                 in turn; with shards, shard i lives in the memory of node i" << endl;
+  cout << "                 modulo the nodes and threads only touch their node's shards" << endl;
+}
+
+/**
+ * Runs one synthetic workload against the tree in every
+ * locking mode, or just the one asked for.
+ */
+int main(int argc, char* argv[])
+{
+  workload w;
+  w.threads = 4;
+  w.size = 100000;
+  w.range = 0;
+  w.dist = uniform_keys;
+  w.theta = 0.99;
+  w.search_percent = 90;
+  w.insert_percent = 5;
+  w.seconds = 1.0;
+  w.rwlock = "monitor";
+  w.shards = 0;
+  w.by_range = false;
+  w.combine = false;
+  w.freeze = false;
+  w.pin = false;
+  int only = -1;
+  bool rbtree_rows = true, btree_rows = false;
+  int delete_percent = 5;
+
+  static struct option long_options[] = {
+    { "threads", required_argument, NULL, 't' },
+    { "size", required_argument, NULL, 'n' },
+    { "range", required_argument, NULL, 'k' },
+    { "dist", required_argument, NULL, 'd' },
+    { "theta", required_argument, NULL, 'z' },
+    { "mix", required_argument, NULL, 'x' },
+    { "seconds", required_argument, NULL, 's' },
+    { "lock", required_argument, NULL, 'l' },
+    { "rwlock", required_argument, NULL, 'r' },
+    { "shards", required_argument, NULL, 'S' },
+    { "range-shards", no_argument, NULL, 'R' },
+    { "combine", no_argument, NULL, 'c' },
+    { "engine", required_argument, NULL, 'e' },
+    { "freeze", no_argument, NULL, 'f' },
+    { "pin", no_argument, NULL, 'P' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  bool bad = false;
+  while((opt = getopt_long(argc, argv, "t:n:k:d:z:x:s:l:r:S:Rce:fP", long_options, NULL)) != -1) {
+    switch(opt) {
+    case 't':
+      w.threads = atoi(optarg);
+      break;
+    case 'n':
+      w.size = atol(optarg);
+      break;
+    case 'k':
+      w.range = atol(optarg);
+      break;
+    case 'd':
+      if(string(optarg) == "uniform") w.dist = uniform_keys;
+      else if(string(optarg) == "zipf") w.dist = zipf_keys;
+      else if(string(optarg) == "sequential") w.dist = sequential_keys;
+      else bad = true;
+      break;
+    case 'z':
+      w.theta = atof(optarg);
+      break;
+    case 'x':
+      if(sscanf(optarg, "%d/%d/%d", &w.search_percent, &w.insert_percent, &delete_percent) != 3) {
+	bad = true;
+      }
+      break;
+    case 's':
+      w.seconds = atof(optarg);
+      break;
+    case 'l':
+      if(string(optarg) == "global") only = global_lock;
+      else if(string(optarg) == "coupling") only = lock_coupling;
+      else if(string(optarg) == "rcu") only = rcu;
+      else if(string(optarg) == "optimistic") only = optimistic;
+      else bad = true;
+      if(only != -1 && !bench_tree::supports((lock_mode) only)) bad = true;
+      break;
+    case 'r':
+      w.rwlock = optarg;
+      break;
+    case 'S':
+      w.shards = atoi(optarg);
+      break;
+    case 'R':
+      w.by_range = true;
+      break;
+    case 'c':
+      w.combine = true;
+      break;
+    case 'f':
+      w.freeze = true;
+      break;
+    case 'P':
+      w.pin = true;
+      break;
+    case 'e':
+      rbtree_rows = string(optarg) == "rbtree" || string(optarg) == "all";
+      btree_rows = string(optarg) == "btree" || string(optarg) == "all";
+      if(!rbtree_rows && !btree_rows) bad = true;
+      break;
+    default:
+      bad = true;
+    }
+  }
+  if(w.range == 0) w.range = 2 * w.size;
+
+  rw_lock* probe = make_rw_lock(w.rwlock);
+  if(probe == NULL) bad = true;
+  delete probe;
+
+  if(bad || optind < argc || w.threads < 1 || w.threads > MAX_READERS || w.shards < 0 ||
+     w.size < 1 || w.range < w.size || w.range > INT32_MAX ||
+     w.theta <= 0 || w.theta >= 1 || w.seconds <= 0 ||
+     w.search_percent < 0 || w.insert_percent < 0 || delete_percent < 0 ||
+     w.search_percent + w.insert_percent + delete_percent != 100) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  zipf_gen* zipf = w.dist == zipf_keys ? new zipf_gen(w.range, w.theta) : NULL;
+
+  cout << w.threads << " threads, " << w.size << " keys in [0, " << w.range << "), "
+       << dist_names[w.dist];
+  if(w.dist == zipf_keys) cout << " (theta " << w.theta << ")";
+  cout << " keys, " << w.search_percent << "/" << w.insert_percent << "/" << delete_percent
+       << " search/insert/delete, " << w.seconds << "s per mode";
+  if(w.shards > 0) cout << ", " << w.shards << (w.by_range ? " range" : " hashed") << " shards";
+  else if(w.combine) cout << ", combined writes";
+  if(w.freeze) cout << ", frozen";
+  if(w.pin) cout << ", pinned";
+  cout << endl;
+  cout << left << setw(10) << "mode" << right << setw(10) << "Mops/s"
+       << setw(10) << "search" << setw(10) << "insert" << setw(10) << "delete"
+       << setw(9) << "p50 ns" << setw(9) << "p90" << setw(9) << "p99" << setw(9) << "p99.9" << endl;
+
+  for(int m = global_lock; m <= optimistic && rbtree_rows; m++) {
+    // compact nodes leave out the modes that lock single nodes
+    if(!bench_tree::supports((lock_mode) m)) continue;
+    if(only == -1 || only == m) run((lock_mode) m, w, zipf, false);
+  }
+  if(btree_rows) run(global_lock, w, zipf, true);
+  delete zipf;
+  return 0;
+}